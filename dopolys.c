@@ -38,63 +38,33 @@ void recurse_list(int flag, int *cells, int sz, int start)
 }
 */
 
-struct rec {
-    int flag;
-    int* cells;
-    int sz;
-    int start;
-};
-
-void recurse_list(struct queue* q, int flag, int *cells, int sz, int start)
+/* label every cell connected to the one at start; a cell is labelled as
+ * it is queued so that it is queued only once */
+void recurse_list(struct deque* q, int flag, int *cells, size_t sz, size_t start)
 {
+    size_t cnt;
+    int i, j, ii, jj;
 
-    struct rec* r = (struct rec*) calloc(1, sizeof(struct rec));
-    r->flag = flag;
-    r->cells = cells;
-    r->sz = sz;
-    r->start = start;
-    queue_push(q, r);
+    cells[start + 2] = flag;
+    deque_push(q, &start);
 
-    int cnt, i, j, ii, jj;
-    struct rec* rr;
-
-    while((r = queue_pop(q))) {
-
-        i = r->cells[r->start];
-        j = r->cells[r->start + 1];
-        r->cells[r->start + 2] = r->flag;
-
-        for (cnt = 0; cnt < r->sz; cnt += 3) {
-            ii = r->cells[cnt];
-            jj = r->cells[cnt + 1];
-
-            if (ii == i - 1 && (jj == j - 1 || jj == j || jj == j + 1)) {
-                if (cells[cnt + 2] == 0) {
-                    rr = (struct rec*) calloc(1, sizeof(struct rec));
-                    rr->flag = flag;
-                    rr->cells = cells;
-                    rr->sz = sz;
-                    rr->start = cnt;
-                    queue_insert(q, rr);
-                }
+    while (deque_pop(q, &start)) {
+
+        i = cells[start];
+        j = cells[start + 1];
+
+        for (cnt = 0; cnt < sz; cnt += 3) {
+            if (cells[cnt + 2] != 0)
+                continue;
+            ii = cells[cnt];
+            jj = cells[cnt + 1];
+
+            if ((ii == i - 1 || ii == i + 1) && (jj == j - 1 || jj == j || jj == j + 1)) {
+                cells[cnt + 2] = flag;
+                deque_insert(q, &cnt);
             } else if (ii == i && (jj == j - 1 || jj == j + 1)) {
-                if (cells[cnt + 2] == 0) {
-                    rr = (struct rec*) calloc(1, sizeof(struct rec));
-                    rr->flag = flag;
-                    rr->cells = cells;
-                    rr->sz = sz;
-                    rr->start = cnt;
-                    queue_insert(q, rr);
-                }
-            } else if (ii == i + 1 && (jj == j - 1 || jj == j || jj == j + 1)) {
-                if (cells[cnt + 2] == 0) {
-                    rr = (struct rec*) calloc(1, sizeof(struct rec));
-                    rr->flag = flag;
-                    rr->cells = cells;
-                    rr->sz = sz;
-                    rr->start = cnt;
-                    queue_insert(q, rr);                    
-                }
+                cells[cnt + 2] = flag;
+                deque_insert(q, &cnt);
             }
         }
     }
@@ -105,31 +75,26 @@ void recurse_list(struct queue* q, int flag, int *cells, int sz, int start)
  * values.  The list will contain the row and column of the cell and a space
  * to include the polygon number */
 
-int dopolys(char* dirs, char* prob, int nl, int ns)
+int dopolys(struct rows* dirs, struct spans* prob, int nl, int ns, struct nullmask *mask)
 {
-    int cnt, i, j, found, flag;
-    int bufsz, cellsz;
+    int i, j, flag;
+    size_t k, cnt, found, cellsz;
     int *cells;
     int *dir;
 
-    char* dirsbuf;
-    char* probbuf;
-
-    bufsz = ns * sizeof(int);
     dir = (int *)G_calloc(ns, sizeof(int));
     cellsz = 3 * ns;
     cells = (int *)G_malloc(cellsz * sizeof(int));
 
     found = 0;
 
-    dirsbuf = dirs;
-
+    /* the list holds rows 1 to nl - 2 */
     for (i = 1; i < nl - 1; i += 1) {
-    	memcpy(dir, dirsbuf, bufsz);
-    	dirsbuf += bufsz;
+    	rows_get(dirs, i, dir);
 
-		for (j = 1; j < ns - 1; j += 1) {
-		    if (Rast_is_c_null_value(&dir[j]) || dir[j] >= 0)
+		for (j = nullmask_next(mask, i, 1, ns - 1); j < ns - 1;
+		     j = nullmask_next(mask, i, j + 1, ns - 1)) {
+		    if (dir[j] >= 0)
 				continue;
 		    cells[found++] = i;
 		    cells[found++] = j;
@@ -141,40 +106,44 @@ int dopolys(char* dirs, char* prob, int nl, int ns)
 		    }
 		}
     }
-    if (found == 0)
+    if (found == 0) {
+		/* clear the areas left by an earlier pass */
+		spans_clear(prob);
+		G_free(cells);
+		G_free(dir);
 		return 0;
+    }
 
     /* Loop through the list, assigning polygon numbers to unassigned entries
        and carrying the same assignment over to adjacent cells.  Repeat
        recursively */
 
-    struct queue* q = queue_init(&q_deleter);
+    struct deque q;
+
+    deque_init(&q, sizeof(size_t));
 
     flag = 0;
-    for (i = 0; i < found; i += 3) {
-		if (cells[i + 2] == 0) {
+    for (k = 0; k < found; k += 3) {
+		if (cells[k + 2] == 0) {
 		    flag += 1;
-	    	recurse_list(q, flag, cells, found, i);
+	    	recurse_list(&q, flag, cells, found, k);
 		}
     }
     
-    queue_free(q);
+    deque_free(&q);
     
     G_message(n_("Found %d unresolved area", "Found %d unresolved areas", flag), flag);
 
     /* Compose a new raster map to contain the resulting assignments */
-    probbuf = prob;
-
     cnt = 0;
     for (i = 0; i < nl; i += 1) {
 		for (j = 0; j < ns; j += 1)
 	    	dir[j] = -1;
-		while (cells[cnt] == i) {
+		while (cnt < found && cells[cnt] == i) {
 	    	dir[cells[cnt + 1]] = cells[cnt + 2];
 	    	cnt += 3;
 		}
-		memcpy(probbuf, dir, bufsz);
-		probbuf += bufsz;
+		spans_put_row(prob, i, dir);
     }
 
     G_free(cells);
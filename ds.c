@@ -1,77 +1,588 @@
 #include <stdlib.h>
+#include <string.h>
 #include "ds.h"
 
-struct queue* queue_init(void (*deleter)(void*)) {
-    struct queue* q = (struct queue*) calloc(1, sizeof(struct queue));
-    q->deleter = deleter;
-    return q;
+void deque_init(struct deque* d, size_t esz) {
+    memset(d, 0, sizeof(struct deque));
+    d->esz = esz;
 }
 
-void queue_free(struct queue* q) {
-    queue_clear(q);
-    free(q);
+void deque_free(struct deque* d) {
+    free(d->v);
+    d->v = 0;
+    d->head = d->n = d->sz = 0;
 }
 
-void* queue_pop(struct queue* q) {
-    struct node* n = 0;
-    void* v = 0;
-    if(q->head) {
-        n = q->head;
-        if(q->head == q->tail) {
-            q->head = q->tail = 0;
+static void deque_grow(struct deque* d) {
+    size_t sz = d->sz ? 2 * d->sz : 1024;
+
+    d->v = (char*) realloc(d->v, sz * d->esz);
+    /* unwrap the part that sits before the head */
+    memcpy(d->v + d->sz * d->esz, d->v, d->head * d->esz);
+    d->sz = sz;
+}
+
+void deque_push(struct deque* d, const void* value) {
+    if(d->n == d->sz)
+        deque_grow(d);
+    memcpy(d->v + ((d->head + d->n++) % d->sz) * d->esz, value, d->esz);
+}
+
+void deque_insert(struct deque* d, const void* value) {
+    if(d->n == d->sz)
+        deque_grow(d);
+    d->head = (d->head + d->sz - 1) % d->sz;
+    memcpy(d->v + d->head * d->esz, value, d->esz);
+    ++d->n;
+}
+
+int deque_pop(struct deque* d, void* value) {
+    if(!d->n)
+        return 0;
+    memcpy(value, d->v + d->head * d->esz, d->esz);
+    d->head = (d->head + 1) % d->sz;
+    --d->n;
+    return 1;
+}
+
+#define ARENA_BLOCK 65536
+#define ARENA_ALIGN 16
+
+void* arena_alloc(struct arena* a, size_t sz) {
+    struct arena_block* b = a->top;
+    size_t hdr = (sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    void* p;
+
+    sz = (sz + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    if(!b || b->used + sz > b->sz) {
+        b = (struct arena_block*) malloc(hdr + (sz > ARENA_BLOCK ? sz : ARENA_BLOCK));
+        b->next = a->top;
+        b->used = 0;
+        b->sz = sz > ARENA_BLOCK ? sz : ARENA_BLOCK;
+        a->top = b;
+    }
+    p = (char*) b + hdr + b->used;
+    b->used += sz;
+    return p;
+}
+
+void arena_free(struct arena* a) {
+    struct arena_block* b;
+
+    while((b = a->top)) {
+        a->top = b->next;
+        free(b);
+    }
+}
+
+struct spans* spans_init(int nrows, int ncols) {
+    struct spans* s = (struct spans*) calloc(1, sizeof(struct spans));
+    s->nrows = nrows;
+    s->ncols = ncols;
+    s->rows = (struct span_row*) calloc(nrows, sizeof(struct span_row));
+    return s;
+}
+
+void spans_free(struct spans* s) {
+    int i;
+    for(i = 0; i < s->nrows; ++i) {
+        free(s->rows[i].v);
+        free(s->rows[i].dense);
+    }
+    free(s->rows);
+    free(s);
+}
+
+void spans_clear(struct spans* s) {
+    int i;
+    for(i = 0; i < s->nrows; ++i) {
+        s->rows[i].n = 0;
+        free(s->rows[i].dense);
+        s->rows[i].dense = NULL;
+    }
+}
+
+void spans_get_row(const struct spans* s, int row, int* buf) {
+    const struct span_row* r = s->rows + row;
+    int i, j;
+
+    if(r->dense) {
+        memcpy(buf, r->dense, s->ncols * sizeof(int));
+        return;
+    }
+    for(j = 0; j < s->ncols; ++j)
+        buf[j] = -1;
+    for(i = 0; i < r->n; ++i) {
+        for(j = r->v[i].start; j < r->v[i].end; ++j)
+            buf[j] = r->v[i].value;
+    }
+}
+
+/* the runs of values other than -1 in a row */
+static int count_runs(const int* buf, int ncols) {
+    int j, n = 0;
+
+    for(j = 0; j < ncols; ++j) {
+        if(buf[j] != -1 && (j == 0 || buf[j - 1] != buf[j]))
+            ++n;
+    }
+    return n;
+}
+
+/* pack the n runs of buf into r, growing it only as far as they need */
+static void pack_spans(struct span_row* r, const int* buf, int ncols, int n) {
+    int j, k;
+
+    if(n > r->sz) {
+        r->sz = n;
+        r->v = (struct span*) realloc(r->v, r->sz * sizeof(struct span));
+    }
+    r->n = 0;
+    for(j = 0; j < ncols; j = k) {
+        for(k = j + 1; k < ncols && buf[k] == buf[j]; ++k)
+            ;
+        if(buf[j] == -1)
+            continue;
+        r->v[r->n].start = j;
+        r->v[r->n].end = k;
+        r->v[r->n].value = buf[j];
+        ++r->n;
+    }
+}
+
+void spans_put_row(struct spans* s, int row, const int* buf) {
+    struct span_row* r = s->rows + row;
+    int n = count_runs(buf, s->ncols);
+
+    if((size_t) n * sizeof(struct span) > (size_t) s->ncols * sizeof(int)) {
+        free(r->v);
+        r->v = NULL;
+        r->n = r->sz = 0;
+        if(!r->dense)
+            r->dense = (int*) malloc(s->ncols * sizeof(int));
+        memcpy(r->dense, buf, s->ncols * sizeof(int));
+        return;
+    }
+    free(r->dense);
+    r->dense = NULL;
+    pack_spans(r, buf, s->ncols, n);
+}
+
+void spans_runs(const struct spans* s, int row, struct span_row* r) {
+    const int* buf = s->rows[row].dense;
+
+    pack_spans(r, buf, s->ncols, count_runs(buf, s->ncols));
+}
+
+size_t spans_max_bytes(int nrows, int ncols) {
+    return sizeof(struct spans) +
+        (size_t) nrows * (sizeof(struct span_row) + ncols * sizeof(int));
+}
+
+struct nullmask* nullmask_init(int nrows, int ncols) {
+    struct nullmask* m = (struct nullmask*) calloc(1, sizeof(struct nullmask));
+    m->nrows = nrows;
+    m->ncols = ncols;
+    m->wpr = (ncols + 63) / 64;
+    m->bits = (uint64_t*) calloc((size_t) nrows * m->wpr, sizeof(uint64_t));
+    return m;
+}
+
+void nullmask_free(struct nullmask* m) {
+    free(m->bits);
+    free(m);
+}
+
+void nullmask_set(struct nullmask* m, int row, int col) {
+    m->bits[(size_t) row * m->wpr + (col >> 6)] |= (uint64_t) 1 << (col & 63);
+}
+
+/* return the first non-null column at or after col in the row, or end if
+ * there is none before end. Whole words of nulls are skipped at once. */
+int nullmask_next(const struct nullmask* m, int row, int col, int end) {
+    const uint64_t* w = m->bits + (size_t) row * m->wpr;
+    int k = col >> 6;
+    uint64_t free_bits;
+
+    if(col >= end)
+        return end;
+    free_bits = ~w[k] & (~(uint64_t) 0 << (col & 63));
+    while(!free_bits) {
+        if(++k >= m->wpr || (k << 6) >= end)
+            return end;
+        free_bits = ~w[k];
+    }
+    col = (k << 6) + __builtin_ctzll(free_bits);
+    return col < end ? col : end;
+}
+void blocks_arrange(char* buf, int nl, int ns, size_t esz, int to_blocks) {
+    int b;
+
+#pragma omp parallel
+    {
+        char* band;
+        char* tmp = (char*) malloc((size_t) BLOCK * ns * esz);
+        int i, j, h, w;
+        size_t r, k;
+
+#pragma omp for schedule(static)
+        for(b = 0; b < nl; b += BLOCK) {
+            h = nl - b < BLOCK ? nl - b : BLOCK;
+            band = buf + (size_t) b * ns * esz;
+            memcpy(tmp, band, (size_t) h * ns * esz);
+            for(j = 0; j < ns; j += BLOCK) {
+                w = ns - j < BLOCK ? ns - j : BLOCK;
+                for(i = 0; i < h; i++) {
+                    r = ((size_t) i * ns + j) * esz;
+                    k = ((size_t) j * h + (size_t) i * w) * esz;
+                    if(to_blocks)
+                        memcpy(band + k, tmp + r, w * esz);
+                    else
+                        memcpy(band + r, tmp + k, w * esz);
+                }
+            }
+        }
+        free(tmp);
+    }
+}
+
+#define ZROWS_RUNS 0
+#define ZROWS_TABLE 1
+#define ZROWS_RAW 2
+
+struct zrows* zrows_init(int nrows, int ncols) {
+    struct zrows* z = (struct zrows*) calloc(1, sizeof(struct zrows));
+    size_t n = (size_t) ZROWS_BLOCK * ncols;
+    int k;
+
+    z->nrows = nrows;
+    z->ncols = ncols;
+    z->nblocks = (nrows + ZROWS_BLOCK - 1) / ZROWS_BLOCK;
+    z->z = (uint32_t**) calloc(z->nblocks, sizeof(uint32_t*));
+    z->zn = (size_t*) calloc(z->nblocks, sizeof(size_t));
+    z->tmp = (uint32_t*) malloc((n + n / 2 + 32) * sizeof(uint32_t));
+    for(k = 0; k < ZROWS_SLOTS; k++)
+        z->slot[k].block = -1;
+    return z;
+}
+
+void zrows_free(struct zrows* z) {
+    int k;
+
+    for(k = 0; k < z->nblocks; k++)
+        free(z->z[k]);
+    for(k = 0; k < ZROWS_SLOTS; k++)
+        free(z->slot[k].v);
+    free(z->z);
+    free(z->zn);
+    free(z->tmp);
+    free(z);
+}
+
+/* Runs of three or more equal words are a header with the top bit set and
+ * the word; other words go as they are after a header with their count. */
+static size_t pack_runs(const uint32_t* v, size_t n, uint32_t* out) {
+    size_t i, k, r, hdr;
+
+    i = k = 0;
+    while(i < n) {
+        for(r = 1; i + r < n && v[i + r] == v[i] && r < 0x7fffffff; r++)
+            ;
+        if(r >= 3) {
+            out[k++] = 0x80000000u | (uint32_t) r;
+            out[k++] = v[i];
+            i += r;
+            continue;
+        }
+        hdr = k++;
+        for(r = 0; i < n && r < 0x7fffffff &&
+                !(i + 2 < n && v[i] == v[i + 1] && v[i] == v[i + 2]); r++)
+            out[k++] = v[i++];
+        out[hdr] = (uint32_t) r;
+    }
+    return k;
+}
+
+static void unpack_runs(const uint32_t* in, uint32_t* v, size_t n) {
+    size_t i, r;
+
+    i = 0;
+    while(i < n) {
+        r = *in & 0x7fffffff;
+        if(*in++ & 0x80000000u) {
+            while(r--)
+                v[i++] = *in;
+            in++;
         } else {
-            q->head = q->head->next;
+            memcpy(v + i, in, r * sizeof(uint32_t));
+            in += r;
+            i += r;
         }
-        --q->size;
     }
-    if(n) {
-        v = n->value;
-        free(n);
+}
+
+/* compress a block into z->tmp; returns the words used */
+static size_t pack_block(struct zrows* z, const uint32_t* v, size_t n) {
+    uint32_t table[16], *out;
+    size_t i, nruns;
+    int t, ntable;
+
+    out = z->tmp;
+    out[0] = ZROWS_RUNS;
+    nruns = 1 + pack_runs(v, n, out + 1);
+
+    ntable = 0;
+    for(i = 0; i < n && ntable <= 16; i++) {
+        for(t = 0; t < ntable && table[t] != v[i]; t++)
+            ;
+        if(t == ntable && ntable++ < 16)
+            table[t] = v[i];
     }
-    return v;
+    if(ntable > 16 && nruns > 1 + n) {
+        out[0] = ZROWS_RAW;
+        memcpy(out + 1, v, n * sizeof(uint32_t));
+        return 1 + n;
+    }
+    if(ntable > 16 || 2 + ntable + (n + 7) / 8 >= nruns)
+        return nruns;
+
+    out[0] = ZROWS_TABLE;
+    out[1] = ntable;
+    memcpy(out + 2, table, ntable * sizeof(uint32_t));
+    out += 2 + ntable;
+    memset(out, 0, (n + 7) / 8 * sizeof(uint32_t));
+    for(i = 0; i < n; i++) {
+        for(t = 0; table[t] != v[i]; t++)
+            ;
+        out[i >> 3] |= (uint32_t) t << ((i & 7) << 2);
+    }
+    return 2 + ntable + (n + 7) / 8;
 }
 
-int queue_push(struct queue* q, void* value) {
-    struct node* n = (struct node*) calloc(1, sizeof(struct node));
-    n->value = value;
-    if(!q->tail) {
-        q->head = q->tail = n;
-    } else {
-        q->tail->next = n;
-        q->tail = n;
+static void unpack_block(const uint32_t* in, uint32_t* v, size_t n) {
+    const uint32_t* codes;
+    size_t i;
+
+    if(in[0] == ZROWS_RUNS) {
+        unpack_runs(in + 1, v, n);
+        return;
+    }
+    if(in[0] == ZROWS_RAW) {
+        memcpy(v, in + 1, n * sizeof(uint32_t));
+        return;
     }
-    return ++q->size;
+    codes = in + 2 + in[1];
+    for(i = 0; i < n; i++)
+        v[i] = in[2 + ((codes[i >> 3] >> ((i & 7) << 2)) & 15)];
 }
 
-int queue_insert(struct queue* q, void* value) {
-    struct node* n = (struct node*) calloc(1, sizeof(struct node));
-    n->value = value;
-    if(!q->head) {
-        q->head = q->tail = n;
+static size_t block_words(struct zrows* z, int b) {
+    int h = z->nrows - b * ZROWS_BLOCK;
+
+    return (size_t) (h < ZROWS_BLOCK ? h : ZROWS_BLOCK) * z->ncols;
+}
+
+/* the expanded block holding a row, compressing the least recently used
+ * block to make room for it */
+static struct zslot* zrows_slot(struct zrows* z, int row) {
+    struct zslot* s;
+    size_t n;
+    int b, k;
+
+    b = row / ZROWS_BLOCK;
+    s = z->slot;
+    for(k = 0; k < ZROWS_SLOTS; k++) {
+        if(z->slot[k].block == b) {
+            s = z->slot + k;
+            s->used = ++z->clock;
+            return s;
+        }
+        if(z->slot[k].used < s->used)
+            s = z->slot + k;
+    }
+
+    if(s->block >= 0 && s->dirty) {
+        n = pack_block(z, s->v, block_words(z, s->block));
+        free(z->z[s->block]);
+        z->z[s->block] = (uint32_t*) malloc(n * sizeof(uint32_t));
+        memcpy(z->z[s->block], z->tmp, n * sizeof(uint32_t));
+        z->zn[s->block] = n;
+    }
+    if(!s->v)
+        s->v = (uint32_t*) malloc((size_t) ZROWS_BLOCK * z->ncols * sizeof(uint32_t));
+
+    n = block_words(z, b);
+    if(z->z[b])
+        unpack_block(z->z[b], s->v, n);
+    else
+        memset(s->v, 0, n * sizeof(uint32_t));
+    s->block = b;
+    s->dirty = 0;
+    s->used = ++z->clock;
+    return s;
+}
+
+void zrows_get(struct zrows* z, int row, void* buf) {
+    struct zslot* s = zrows_slot(z, row);
+
+    memcpy(buf, s->v + (size_t) (row % ZROWS_BLOCK) * z->ncols,
+           z->ncols * sizeof(uint32_t));
+}
+
+void zrows_put(struct zrows* z, int row, const void* buf) {
+    struct zslot* s = zrows_slot(z, row);
+
+    memcpy(s->v + (size_t) (row % ZROWS_BLOCK) * z->ncols, buf,
+           z->ncols * sizeof(uint32_t));
+    s->dirty = 1;
+}
+
+size_t zrows_bytes(const struct zrows* z) {
+    size_t n = 0;
+    int k;
+
+    for(k = 0; k < z->nblocks; k++)
+        n += z->zn[k] * sizeof(uint32_t);
+    for(k = 0; k < ZROWS_SLOTS; k++)
+        if(z->slot[k].v)
+            n += (size_t) ZROWS_BLOCK * z->ncols * sizeof(uint32_t);
+    return n;
+}
+
+size_t zrows_max_bytes(int nrows, int ncols) {
+    size_t n = (size_t) ZROWS_BLOCK * ncols;
+    int nblocks = (nrows + ZROWS_BLOCK - 1) / ZROWS_BLOCK;
+
+    /* every block as it is, the expanded slots and the room to pack one */
+    return sizeof(struct zrows) +
+        (size_t) nblocks * (sizeof(uint32_t*) + sizeof(size_t) + sizeof(uint32_t)) +
+        (size_t) nrows * ncols * sizeof(uint32_t) +
+        (ZROWS_SLOTS * n + n + n / 2 + 32) * sizeof(uint32_t);
+}
+
+void heap_push(struct heap* h, double key, off_t cell) {
+    off_t i, p;
+
+    if(h->n == h->sz) {
+        h->sz = h->sz ? 2 * h->sz : 1024;
+        h->v = (struct heap_node*) realloc(h->v, h->sz * sizeof(struct heap_node));
+    }
+    for(i = h->n++; i > 0; i = p) {
+        p = (i - 1) / 2;
+        if(h->v[p].key <= key)
+            break;
+        h->v[i] = h->v[p];
+    }
+    h->v[i].key = key;
+    h->v[i].cell = cell;
+}
+
+off_t heap_pop(struct heap* h) {
+    off_t i, c, cell;
+    struct heap_node last;
+
+    cell = h->v[0].cell;
+    last = h->v[--h->n];
+    for(i = 0; (c = 2 * i + 1) < h->n; i = c) {
+        if(c + 1 < h->n && h->v[c + 1].key < h->v[c].key)
+            ++c;
+        if(last.key <= h->v[c].key)
+            break;
+        h->v[i] = h->v[c];
+    }
+    h->v[i] = last;
+    return cell;
+}
+
+void heap_free(struct heap* h) {
+    free(h->v);
+    h->v = 0;
+    h->n = h->sz = 0;
+}
+
+void pq_init(struct pq* q, int bucketed) {
+    memset(q, 0, sizeof(struct pq));
+    q->bucketed = bucketed;
+    q->cur = PQ_BUCKETS;
+    q->free = -1;
+}
+
+static void pq_bucket(struct pq* q, int b, off_t cell) {
+    off_t e;
+
+    if(q->free >= 0) {
+        e = q->free;
+        q->free = q->pool[e].next;
     } else {
-        n->next = q->head;
-        q->head = n;
+        if(q->npool == q->szpool) {
+            q->szpool = q->szpool ? 2 * q->szpool : 1024;
+            q->pool = (struct pq_entry*) realloc(q->pool, q->szpool * sizeof(struct pq_entry));
+        }
+        e = q->npool++;
+    }
+    q->pool[e].cell = cell;
+    q->pool[e].next = q->head[b];
+    q->head[b] = e;
+    ++q->n;
+}
+
+void pq_push(struct pq* q, double key, off_t cell) {
+    long long b;
+
+    /* until the first pop, and for keys past the window, use the heap */
+    if(!q->bucketed || !q->head || (b = (long long) key - q->base) >= PQ_BUCKETS) {
+        heap_push(&q->over, key, cell);
+        return;
     }
-    return ++q->size;
+    /* a key below the last one popped can only come from a caller that
+     * breaks the order; it is taken as the current key */
+    pq_bucket(q, b > q->cur ? (int) b : q->cur, cell);
 }
 
-void queue_clear(struct queue* q) {
-    struct node* n;
-    while((n = queue_pop(q))) {
-        q->deleter(n->value);
-        free(n);
+/* move the window up to the lowest key in the heap */
+static void pq_refill(struct pq* q) {
+    off_t cell;
+    int i;
+
+    if(!q->head) {
+        q->head = (off_t*) malloc(PQ_BUCKETS * sizeof(off_t));
+        for(i = 0; i < PQ_BUCKETS; ++i)
+            q->head[i] = -1;
+    }
+    q->base = (long long) q->over.v[0].key;
+    q->cur = 0;
+    while(q->over.n > 0 && (long long) q->over.v[0].key - q->base < PQ_BUCKETS) {
+        i = (int) ((long long) q->over.v[0].key - q->base);
+        cell = heap_pop(&q->over);
+        pq_bucket(q, i, cell);
     }
-    q->size = 0;
 }
 
-int queue_size(struct queue* q) {
-    return q->size;
+off_t pq_pop(struct pq* q) {
+    off_t e;
+
+    if(!q->bucketed)
+        return heap_pop(&q->over);
+    if(q->n == 0)
+        pq_refill(q);
+    while(q->head[q->cur] < 0)
+        ++q->cur;
+    e = q->head[q->cur];
+    q->head[q->cur] = q->pool[e].next;
+    q->pool[e].next = q->free;
+    q->free = e;
+    --q->n;
+    return q->pool[e].cell;
 }
 
-int queue_empty(struct queue* q) {
-    return q->size == 0;
+off_t pq_size(struct pq* q) {
+    return q->n + q->over.n;
 }
 
-void q_deleter(void* item) {
-    free(item);
-}
\ No newline at end of file
+void pq_free(struct pq* q) {
+    heap_free(&q->over);
+    free(q->head);
+    free(q->pool);
+    q->head = 0;
+    q->pool = 0;
+}
@@ -1,34 +1,250 @@
 #ifndef __DS_H__
 #define __DS_H__
 
-struct node {
-    struct node* next;
-    void* value;
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* Double-ended queue of fixed-size values, kept inline in one growable
+ * ring buffer. */
+struct deque {
+    char* v;
+    size_t esz;
+    size_t head;
+    size_t n;
+    size_t sz;
+};
+
+void deque_init(struct deque* d, size_t esz);
+
+void deque_free(struct deque* d);
+
+/* add a value at the back */
+void deque_push(struct deque* d, const void* value);
+
+/* add a value at the front */
+void deque_insert(struct deque* d, const void* value);
+
+/* take the value at the front; 0 if the deque is empty */
+int deque_pop(struct deque* d, void* value);
+
+static inline size_t deque_size(const struct deque* d) {
+    return d->n;
+}
+
+/* Bump allocator for scratch that lives as long as one stage. Nothing is
+ * freed on its own; arena_free() releases it all at once. */
+struct arena_block {
+    struct arena_block* next;
+    size_t used;
+    size_t sz;
+};
+
+struct arena {
+    struct arena_block* top;
+};
+
+void* arena_alloc(struct arena* a, size_t sz);
+
+void arena_free(struct arena* a);
+
+/* Runs of equal values on each row of a raster that is mostly -1, such as
+ * the basin numbers. Only the runs of other values are stored; rows are
+ * expanded and packed again a whole row at a time. A row whose runs would
+ * take more than the row itself is kept whole instead, so that no row
+ * takes more than it would in a full raster. */
+struct span {
+    int start;
+    int end;
+    int value;
+};
+
+struct span_row {
+    struct span* v;
+    int n;
+    int sz;
+    int* dense;             /* the whole row, or NULL if it is in v */
+};
+
+struct spans {
+    int nrows;
+    int ncols;
+    struct span_row* rows;
+};
+
+struct spans* spans_init(int nrows, int ncols);
+
+void spans_free(struct spans* s);
+
+/* make every row -1 again */
+void spans_clear(struct spans* s);
+
+/* expand a row into buf, which holds ncols values */
+void spans_get_row(const struct spans* s, int row, int* buf);
+
+/* replace a row with the runs in buf */
+void spans_put_row(struct spans* s, int row, const int* buf);
+
+/* the runs of a row that is kept whole, packed into r */
+void spans_runs(const struct spans* s, int row, struct span_row* r);
+
+/* the most bytes a raster of runs can take */
+size_t spans_max_bytes(int nrows, int ncols);
+
+/* Rows of 32-bit cells kept compressed in blocks of 64 rows. Each block
+ * is stored as runs of equal words or, when it holds no more than 16
+ * values, as 4-bit codes into a table of them, whichever is smaller, and
+ * as it is when neither is smaller than the block itself. A few
+ * blocks are kept expanded for the rows in use and are compressed again
+ * when they are pushed out after being written. Rows are read and written
+ * whole; blocks never written read as zero. */
+#define ZROWS_BLOCK 64
+#define ZROWS_SLOTS 4
+
+struct zslot {
+    int block;              /* -1 if empty */
+    int dirty;
+    unsigned long used;
+    uint32_t* v;
 };
 
-struct queue {
-    struct node* head;
-    struct node* tail;
-    void (*deleter)(void*);
-    int size;
+struct zrows {
+    int nrows;
+    int ncols;
+    int nblocks;
+    uint32_t** z;           /* compressed blocks */
+    size_t* zn;             /* words in each */
+    struct zslot slot[ZROWS_SLOTS];
+    unsigned long clock;
+    uint32_t* tmp;          /* room for a block at its worst */
 };
 
-struct queue* queue_init(void (*deleter)(void*));
+struct zrows* zrows_init(int nrows, int ncols);
 
-void queue_free(struct queue* q);
+void zrows_free(struct zrows* z);
 
-void* queue_pop(struct queue* q);
+void zrows_get(struct zrows* z, int row, void* buf);
 
-int queue_push(struct queue* q, void* value);
+void zrows_put(struct zrows* z, int row, const void* buf);
+
+/* bytes held, compressed and expanded */
+size_t zrows_bytes(const struct zrows* z);
+
+/* the most bytes rows of this size can hold */
+size_t zrows_max_bytes(int nrows, int ncols);
+
+/* The rows of a buffer of directions, either in place or compressed. */
+struct rows {
+    char* buf;              /* NULL when the rows are in z */
+    struct zrows* z;
+    size_t sz;              /* bytes in a row */
+};
+
+static inline void rows_get(struct rows* r, int row, void* buf) {
+    if(r->buf)
+        memcpy(buf, r->buf + (size_t) row * r->sz, r->sz);
+    else
+        zrows_get(r->z, row, buf);
+}
+
+static inline void rows_put(struct rows* r, int row, const void* buf) {
+    if(r->buf)
+        memcpy(r->buf + (size_t) row * r->sz, buf, r->sz);
+    else
+        zrows_put(r->z, row, buf);
+}
+
+/* One bit per cell, set where the input is null. Rows are padded to whole
+ * 64-bit words so that a row can be scanned a word at a time. */
+struct nullmask {
+    int nrows;
+    int ncols;
+    int wpr;
+    uint64_t* bits;
+};
+
+struct nullmask* nullmask_init(int nrows, int ncols);
+
+void nullmask_free(struct nullmask* m);
+
+void nullmask_set(struct nullmask* m, int row, int col);
+
+int nullmask_next(const struct nullmask* m, int row, int col, int end);
+
+static inline int nullmask_get(const struct nullmask* m, int row, int col) {
+    return (m->bits[(size_t) row * m->wpr + (col >> 6)] >> (col & 63)) & 1;
+}
+
+/* Cells in blocks of 64 by 64, the blocks of a band of 64 rows one after
+ * the other and the cells of a block row by row, so that the neighbours
+ * above and below a cell are mostly in the same few pages. A band takes the
+ * same bytes as it does row by row, so a buffer is rearranged in place a
+ * band at a time. The blocks of the last band and column are cut short. */
+#define BLOCK 64
+
+static inline off_t block_cell(int nl, int ns, int i, int j) {
+    int i0 = i & ~(BLOCK - 1);
+    int j0 = j & ~(BLOCK - 1);
+    int h = nl - i0 < BLOCK ? nl - i0 : BLOCK;
+    int w = ns - j0 < BLOCK ? ns - j0 : BLOCK;
+
+    return (off_t) i0 * ns + (off_t) j0 * h + (i - i0) * w + (j - j0);
+}
+
+/* rearrange a buffer of cells of esz bytes from rows to blocks, or back */
+void blocks_arrange(char* buf, int nl, int ns, size_t esz, int to_blocks);
+
+/* Binary min-heap of cells keyed by elevation, stored in one array. */
+struct heap_node {
+    double key;
+    off_t cell;
+};
+
+struct heap {
+    struct heap_node* v;
+    off_t n;
+    off_t sz;
+};
+
+void heap_push(struct heap* h, double key, off_t cell);
+
+off_t heap_pop(struct heap* h);
+
+void heap_free(struct heap* h);
+
+/* Priority queue of cells for flooding, where nothing is pushed below the
+ * last key popped. Integer keys go in a window of buckets that are popped
+ * in O(1), keys beyond the window wait in a heap until the window moves up
+ * to them. Other keys always use the heap. The bucket entries are kept in
+ * one pool and linked by index. */
+#define PQ_BUCKETS 65536
+
+struct pq_entry {
+    off_t cell;
+    off_t next;
+};
+
+struct pq {
+    int bucketed;
+    long long base;         /* key of the first bucket */
+    int cur;                /* lowest bucket that may hold an entry */
+    off_t* head;            /* first entry of each bucket, -1 if empty */
+    struct pq_entry* pool;
+    off_t npool;
+    off_t szpool;
+    off_t free;             /* first unused pool entry, -1 if none */
+    off_t n;                /* entries in the buckets */
+    struct heap over;
+};
 
-int queue_insert(struct queue* q, void* value);
+void pq_init(struct pq* q, int bucketed);
 
-void queue_clear(struct queue* q);
+void pq_push(struct pq* q, double key, off_t cell);
 
-int queue_size(struct queue* q);
+off_t pq_pop(struct pq* q);
 
-int queue_empty(struct queue* q);
+off_t pq_size(struct pq* q);
 
-void q_deleter(void* item);
+void pq_free(struct pq* q);
 
 #endif
@@ -7,15 +7,16 @@
 #include <grass/gis.h>
 #include <grass/raster.h>
 #include "tinf.h"
+#include "ds.h"
 
 /* get the slope between two cells and return a slope direction */
-void check(CELL newdir, CELL * dir, void *center, void *edge, double cnst,
-	   double *oldslope)
+void check(CELL newdir, CELL * dir, void *center, void *edge, int edgenull,
+	   double cnst, double *oldslope)
 {
     double newslope;
 
     /* always discharge to a null boundary */
-    if (is_null(edge)) {
+    if (edgenull) {
 		*oldslope = DBL_MAX;
 		*dir = newdir;
     } else {
@@ -32,8 +33,17 @@ void check(CELL newdir, CELL * dir, void *center, void *edge, double cnst,
 
 }
 
+/* cells next to a null drain into it and are never pits */
+static int next_to_null(struct nullmask *mask, int i, int j)
+{
+    return nullmask_get(mask, i - 1, j - 1) || nullmask_get(mask, i - 1, j) ||
+	nullmask_get(mask, i - 1, j + 1) || nullmask_get(mask, i, j - 1) ||
+	nullmask_get(mask, i, j + 1) || nullmask_get(mask, i + 1, j - 1) ||
+	nullmask_get(mask, i + 1, j) || nullmask_get(mask, i + 1, j + 1);
+}
+
 /* process one row, filling single-cell pits */
-int fill_row(int nl, int ns, struct band3 *bnd)
+int fill_row(int i, int nl, int ns, struct band3 *bnd, struct nullmask *mask)
 {
     int j, offset, inc, rc;
     void *min;
@@ -42,14 +52,14 @@ int fill_row(int nl, int ns, struct band3 *bnd)
 
     inc = bpe();
 
-    min = G_malloc(bpe());
-
     rc = 0;
-    for (j = 1; j < ns - 1; j += 1) {
+    for (j = nullmask_next(mask, i, 1, ns - 1); j < ns - 1;
+	 j = nullmask_next(mask, i, j + 1, ns - 1)) {
+		if (next_to_null(mask, i, j))
+		    continue;
+
 		offset = j * bpe();
 		center = bnd->b[1] + offset;
-		if (is_null(center))
-	    	continue; //return rc;
 
 		edge = bnd->b[0] + offset;
 		min = edge - inc;
@@ -70,13 +80,12 @@ int fill_row(int nl, int ns, struct band3 *bnd)
 		}
     }
 
-    //G_free(min);
-
     return rc;
 }
 
 /* determine the flow direction at each cell on one row */
-void build_one_row(int i, int nl, int ns, struct band3 *bnd, CELL * dir)
+void build_one_row(int i, int nl, int ns, struct band3 *bnd, CELL * dir,
+		   struct nullmask *mask)
 {
     int j, offset, inc;
     CELL sdir;
@@ -86,13 +95,12 @@ void build_one_row(int i, int nl, int ns, struct band3 *bnd, CELL * dir)
 
     inc = bpe();
 
-    for (j = 0; j < ns; j += 1) {
+    Rast_set_c_null_value(dir, ns);
+
+    for (j = nullmask_next(mask, i, 0, ns); j < ns;
+	 j = nullmask_next(mask, i, j + 1, ns)) {
 	offset = j * bpe();
 	center = bnd->b[1] + offset;
-	if (is_null(center)) {
-	    Rast_set_c_null_value(dir + j, 1);
-	    continue;
-	}
 
 	sdir = 0;
 	slope = HUGE_VAL;
@@ -113,19 +121,27 @@ void build_one_row(int i, int nl, int ns, struct band3 *bnd, CELL * dir)
 
 	    /* check one row back */
 	    edge = bnd->b[0] + offset;
-	    check(64, &sdir, center, edge - inc, 1.4142136, &slope);
-	    check(128, &sdir, center, edge, 1., &slope);
-	    check(1, &sdir, center, edge + inc, 1.4142136, &slope);
+	    check(64, &sdir, center, edge - inc,
+		  nullmask_get(mask, i - 1, j - 1), 1.4142136, &slope);
+	    check(128, &sdir, center, edge,
+		  nullmask_get(mask, i - 1, j), 1., &slope);
+	    check(1, &sdir, center, edge + inc,
+		  nullmask_get(mask, i - 1, j + 1), 1.4142136, &slope);
 
 	    /* check this row */
-	    check(32, &sdir, center, center - inc, 1., &slope);
-	    check(2, &sdir, center, center + inc, 1., &slope);
+	    check(32, &sdir, center, center - inc,
+		  nullmask_get(mask, i, j - 1), 1., &slope);
+	    check(2, &sdir, center, center + inc,
+		  nullmask_get(mask, i, j + 1), 1., &slope);
 
 	    /* check one row forward */
 	    edge = bnd->b[2] + offset;
-	    check(16, &sdir, center, edge - inc, 1.4142136, &slope);
-	    check(8, &sdir, center, edge, 1., &slope);
-	    check(4, &sdir, center, edge + inc, 1.4142136, &slope);
+	    check(16, &sdir, center, edge - inc,
+		  nullmask_get(mask, i + 1, j - 1), 1.4142136, &slope);
+	    check(8, &sdir, center, edge,
+		  nullmask_get(mask, i + 1, j), 1., &slope);
+	    check(4, &sdir, center, edge + inc,
+		  nullmask_get(mask, i + 1, j + 1), 1.4142136, &slope);
 	}
 
 	if (slope == 0.)
@@ -138,14 +154,14 @@ void build_one_row(int i, int nl, int ns, struct band3 *bnd, CELL * dir)
 }
 
 //void filldir(int fe, int fd, int nl, struct band3 *bnd)
-void filldir(char* elev, char* dirs, int nl, struct band3 *bnd)
+void filldir(char* elev, struct rows* dirs, int nl, struct band3 *bnd,
+	     struct nullmask *mask)
 {
-    int i, bufsz;
+    int i;
     CELL *dir;
 
-    // Get the starting address of the elev and dirs buffers.
+    // Get the starting address of the elev buffer.
     char* elevbuf;
-    char* dirsbuf;
 
     /* fill single-cell depressions, except on outer rows and columns */
     elevbuf = elev;
@@ -154,46 +170,38 @@ void filldir(char* elev, char* dirs, int nl, struct band3 *bnd)
 
     for (i = 1; i < nl - 1; i += 1) {
 
-    	elevbuf = elev + (i + 1) * bnd->sz;
+    	elevbuf = elev + (off_t) (i + 1) * bnd->sz;
 		advance_band3mem(&elevbuf, bnd);
 
-		if (fill_row(nl, bnd->ns, bnd)) {
-			elevbuf = elev + i * bnd->sz;
+		if (fill_row(i, nl, bnd->ns, bnd, mask)) {
+			elevbuf = elev + (off_t) i * bnd->sz;
 			memcpy(elevbuf, bnd->b[1], bnd->sz);
 			elevbuf += bnd->sz;
 		}
     }
 
-    advance_band3mem(0, bnd);
-
-    if (fill_row(nl, bnd->ns, bnd)) {
-    	elevbuf = elev + i * bnd->sz;
-    	memcpy(elevbuf, bnd->b[1], bnd->sz);
-    	elevbuf += bnd->sz;
-    }
-
     /* determine the flow direction in each cell.  On outer rows and columns
      * the flow direction is always directly out of the map */
 
     dir = G_calloc(bnd->ns, sizeof(CELL));
-    bufsz = bnd->ns * sizeof(CELL);
 
     elevbuf = elev;
-    dirsbuf = dirs;
 
     advance_band3mem(&elevbuf, bnd);
 
     for (i = 0; i < nl - 2; i += 1) {
 		advance_band3mem(&elevbuf, bnd);
-		build_one_row(i, nl, bnd->ns, bnd, dir);
-		memcpy(dirsbuf, dir, bufsz);
-		dirsbuf += bufsz;
+		build_one_row(i, nl, bnd->ns, bnd, dir, mask);
+		rows_put(dirs, i, dir);
     }
 
     advance_band3mem(&elevbuf, bnd);
-    build_one_row(i, nl, bnd->ns, bnd, dir);
-	memcpy(dirsbuf, dir, bufsz);
-	dirsbuf += bufsz;
+    build_one_row(i, nl, bnd->ns, bnd, dir, mask);
+	rows_put(dirs, i, dir);
+
+    advance_band3mem(0, bnd);
+    build_one_row(nl - 1, nl, bnd->ns, bnd, dir, mask);
+	rows_put(dirs, nl - 1, dir);
 
     G_free(dir);
 
@@ -0,0 +1,413 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/types.h>
+#include <grass/gis.h>
+#include <grass/raster.h>
+#include <grass/glocale.h>
+#include "tinf.h"
+#include "ds.h"
+#include "local.h"
+
+/* Priority-flood with an epsilon gradient (Barnes, Lehman and Mulla, 2014).
+ * Cells are visited from the map edges and the null boundaries inward in
+ * order of elevation.  A cell that is not higher than the cell it was
+ * reached from is raised to the next representable value above it, so
+ * every cell ends up with a strictly lower neighbour on its way out.
+ * The floods reach in all directions, so the elevations are held in
+ * blocks while they run; the queues keep cells by row and column. */
+
+void eflood(char *elev, int nl, int ns, struct nullmask *mask)
+{
+    int i, j, k, ii, jj, edge;
+    int di[8] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+    int dj[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+    off_t c, n, bn, raised;
+    char *closed;
+    char *cv, *nv;
+    struct pq open;
+    struct deque pit;
+
+    /* integer maps get the bucket queue */
+    pq_init(&open, bpe == bpe_c);
+    deque_init(&pit, sizeof(off_t));
+    closed = G_calloc((off_t) nl * ns, 1);
+    blocks_arrange(elev, nl, ns, bpe(), 1);
+
+    /* seed with the outer rows and columns and the cells next to nulls */
+    for (i = 0; i < nl; i += 1) {
+	for (j = nullmask_next(mask, i, 0, ns); j < ns;
+	     j = nullmask_next(mask, i, j + 1, ns)) {
+	    edge = i == 0 || i == nl - 1 || j == 0 || j == ns - 1;
+	    for (k = 0; k < 8 && !edge; k += 1)
+		edge = nullmask_get(mask, i + di[k], j + dj[k]);
+	    if (!edge)
+		continue;
+	    c = block_cell(nl, ns, i, j);
+	    closed[c] = 1;
+	    pq_push(&open, get_dbl(elev + c * bpe()), (off_t) i * ns + j);
+	}
+    }
+
+    raised = 0;
+    while (pq_size(&open) > 0 || deque_size(&pit) > 0) {
+	/* cells raised above a pit go first; each is queued once */
+	if (!deque_pop(&pit, &c))
+	    c = pq_pop(&open);
+	i = c / ns;
+	j = c % ns;
+	cv = elev + block_cell(nl, ns, i, j) * bpe();
+	for (k = 0; k < 8; k += 1) {
+	    ii = i + di[k];
+	    jj = j + dj[k];
+	    if (ii < 0 || ii >= nl || jj < 0 || jj >= ns)
+		continue;
+	    bn = block_cell(nl, ns, ii, jj);
+	    if (closed[bn] || nullmask_get(mask, ii, jj))
+		continue;
+	    closed[bn] = 1;
+	    n = (off_t) ii * ns + jj;
+	    nv = elev + bn * bpe();
+	    if (get_max(nv, cv) == cv) {
+		/* not higher than where it drains to: raise it */
+		memcpy(nv, cv, bpe());
+		next_up(nv);
+		deque_push(&pit, &n);
+		raised += 1;
+	    }
+	    else
+		pq_push(&open, get_dbl(nv), n);
+	}
+    }
+
+    G_verbose_message(_("%ld cells raised"), (long)raised);
+
+    blocks_arrange(elev, nl, ns, bpe(), 0);
+    pq_free(&open);
+    deque_free(&pit);
+    G_free(closed);
+}
+
+/* Tiled parallel priority-flood (Barnes, 2016).  The map is cut into
+ * strips of whole rows and each strip is flooded on its own, treating its
+ * first and last rows as outlets.  Every outlet that starts a flood gets a
+ * label, and where two labels meet the lower of the two possible spill
+ * elevations is kept as an edge of a graph.  The labels are kept in the
+ * directions buffer, which is rebuilt by filldir() afterwards; both it
+ * and the elevations are held in blocks until the strips are raised.  The graph
+ * is solved from the map edges to get the level each label has to be
+ * raised to, and the strips are raised in parallel. */
+
+void add_edge(struct sgraph *g, CELL a, CELL b, double w)
+{
+    if (g->n == g->sz) {
+	g->sz = g->sz ? 2 * g->sz : 1024;
+	g->v = G_realloc(g->v, g->sz * sizeof(struct sedge));
+    }
+    g->v[g->n].a = a;
+    g->v[g->n].b = b;
+    g->v[g->n].w = w;
+    g->n += 1;
+}
+
+/* flood rows r0 to r1 - 1, giving new labels from base.  The map edges
+ * drain unless the map is itself a tile of a larger one, when its first
+ * and last columns are outlets like the strip edges.  The elevations and
+ * labels are held in blocks. */
+CELL flood_tile(char *elev, CELL *label, int nl, int ns, int r0, int r1,
+		CELL base, struct nullmask *mask, struct sgraph *g,
+		int edges_drain)
+{
+    int i, j, k, ii, jj, drain;
+    int di[8] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+    int dj[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+    off_t c, n, bc, bn;
+    char *cv, *nv;
+    struct pq open;
+
+    pq_init(&open, bpe == bpe_c);
+
+    for (i = r0; i < r1; i += 1) {
+	for (j = nullmask_next(mask, i, 0, ns); j < ns;
+	     j = nullmask_next(mask, i, j + 1, ns)) {
+	    c = block_cell(nl, ns, i, j);
+	    label[c] = 0;
+	    drain = edges_drain &&
+		(i == 0 || i == nl - 1 || j == 0 || j == ns - 1);
+	    for (k = 0; k < 8 && !drain; k += 1) {
+		ii = i + di[k];
+		jj = j + dj[k];
+		drain = ii >= 0 && ii < nl && jj >= 0 && jj < ns &&
+		    nullmask_get(mask, ii, jj);
+	    }
+	    if (drain)
+		label[c] = OCEAN;
+	    else if (i != r0 && i != r1 - 1 &&
+		     (edges_drain || (j != 0 && j != ns - 1)))
+		continue;
+	    pq_push(&open, get_dbl(elev + c * bpe()), (off_t) i * ns + j);
+	}
+    }
+
+    while (pq_size(&open) > 0) {
+	c = pq_pop(&open);
+	i = c / ns;
+	j = c % ns;
+	bc = block_cell(nl, ns, i, j);
+	cv = elev + bc * bpe();
+	if (label[bc] == 0)
+	    label[bc] = base++;
+	for (k = 0; k < 8; k += 1) {
+	    ii = i + di[k];
+	    jj = j + dj[k];
+	    if (ii < r0 || ii >= r1 || jj < 0 || jj >= ns ||
+		nullmask_get(mask, ii, jj))
+		continue;
+	    bn = block_cell(nl, ns, ii, jj);
+	    nv = elev + bn * bpe();
+	    if (label[bn] != 0) {
+		if (label[bn] != label[bc])
+		    add_edge(g, label[bc], label[bn], get_dbl(get_max(cv, nv)));
+		continue;
+	    }
+	    n = (off_t) ii * ns + jj;
+	    label[bn] = label[bc];
+	    if (get_max(nv, cv) == cv)
+		memcpy(nv, cv, bpe());
+	    pq_push(&open, get_dbl(nv), n);
+	}
+    }
+
+    pq_free(&open);
+    return base;
+}
+
+/* Solve the graph of labels from the map edges.  The spill level of a
+ * label is the lowest of the highest crossings on all the paths from the
+ * map edge to it; labels that cannot reach the edge get HUGE_VAL.  The
+ * edge lists are freed. */
+double *solve_spill(struct sgraph *g, int ng, CELL nlabels)
+{
+    int t;
+    CELL a, b;
+    size_t e, *first, *fill;
+    CELL *to;
+    double *w, *spill, s;
+    struct heap open;
+
+    /* gather the edges into an adjacency list running both ways */
+    first = G_calloc(nlabels + 1, sizeof(size_t));
+    for (t = 0; t < ng; t += 1) {
+	for (e = 0; e < g[t].n; e += 1) {
+	    first[g[t].v[e].a + 1] += 1;
+	    first[g[t].v[e].b + 1] += 1;
+	}
+    }
+    for (a = 0; a < nlabels; a += 1)
+	first[a + 1] += first[a];
+    fill = G_malloc(nlabels * sizeof(size_t));
+    memcpy(fill, first, nlabels * sizeof(size_t));
+    to = G_malloc((first[nlabels] + 1) * sizeof(CELL));
+    w = G_malloc((first[nlabels] + 1) * sizeof(double));
+    for (t = 0; t < ng; t += 1) {
+	for (e = 0; e < g[t].n; e += 1) {
+	    a = g[t].v[e].a;
+	    b = g[t].v[e].b;
+	    to[fill[a]] = b;
+	    w[fill[a]++] = g[t].v[e].w;
+	    to[fill[b]] = a;
+	    w[fill[b]++] = g[t].v[e].w;
+	}
+	G_free(g[t].v);
+	g[t].v = NULL;
+	g[t].n = g[t].sz = 0;
+    }
+    G_free(fill);
+
+    spill = G_malloc(nlabels * sizeof(double));
+    for (a = 0; a < nlabels; a += 1)
+	spill[a] = HUGE_VAL;
+    spill[OCEAN] = -HUGE_VAL;
+
+    memset(&open, 0, sizeof(open));
+    heap_push(&open, spill[OCEAN], OCEAN);
+    while (open.n > 0) {
+	s = open.v[0].key;
+	a = heap_pop(&open);
+	if (s > spill[a])
+	    continue;
+	for (e = first[a]; e < first[a + 1]; e += 1) {
+	    b = to[e];
+	    if ((s > w[e] ? s : w[e]) < spill[b]) {
+		spill[b] = s > w[e] ? s : w[e];
+		heap_push(&open, spill[b], b);
+	    }
+	}
+    }
+    heap_free(&open);
+    G_free(first);
+    G_free(to);
+    G_free(w);
+
+    return spill;
+}
+
+void pflood(char *elev, char *dirs, int nl, int ns, struct nullmask *mask,
+	    int nprocs)
+{
+    int t, ntiles, h, i, j, k;
+    CELL a, b, stride, nlabels;
+    CELL *label = (CELL *) dirs;
+    double *spill;
+    struct sgraph *g;
+    off_t c, n;
+
+    ntiles = nprocs > 1 ? 4 * nprocs : 1;
+    if (ntiles > nl)
+	ntiles = nl;
+    h = (nl + ntiles - 1) / ntiles;
+    ntiles = (nl + h - 1) / h;
+
+    /* new labels only start at the first and last rows of a strip */
+    stride = 2 * ns;
+    nlabels = OCEAN + 1 + ntiles * stride;
+
+    G_verbose_message(_("Flooding %d strips of %d rows"), ntiles, h);
+
+    /* one graph per strip, and one for the edges between strips */
+    g = G_calloc(ntiles + 1, sizeof(struct sgraph));
+    blocks_arrange(elev, nl, ns, bpe(), 1);
+
+#pragma omp parallel for schedule(dynamic)
+    for (t = 0; t < ntiles; t += 1)
+	flood_tile(elev, label, nl, ns, t * h, (t + 1) * h < nl ? (t + 1) * h : nl,
+		   OCEAN + 1 + t * stride, mask, &g[t], 1);
+
+    for (t = 1; t < ntiles; t += 1) {
+	i = t * h;
+	for (j = nullmask_next(mask, i - 1, 0, ns); j < ns;
+	     j = nullmask_next(mask, i - 1, j + 1, ns)) {
+	    c = block_cell(nl, ns, i - 1, j);
+	    a = label[c];
+	    for (k = j - 1; k <= j + 1; k += 1) {
+		if (k < 0 || k >= ns || nullmask_get(mask, i, k))
+		    continue;
+		n = block_cell(nl, ns, i, k);
+		b = label[n];
+		if (a != b)
+		    add_edge(&g[ntiles], a, b,
+			     get_dbl(get_max(elev + c * bpe(), elev + n * bpe())));
+	    }
+	}
+    }
+
+    spill = solve_spill(g, ntiles + 1, nlabels);
+    G_free(g);
+
+    /* raise each cell to the spill level of its label */
+#pragma omp parallel for schedule(static) private(j, c)
+    for (i = 0; i < nl; i += 1) {
+	for (j = nullmask_next(mask, i, 0, ns); j < ns;
+	     j = nullmask_next(mask, i, j + 1, ns)) {
+	    c = block_cell(nl, ns, i, j);
+	    if (spill[label[c]] < HUGE_VAL &&
+		spill[label[c]] > get_dbl(elev + c * bpe()))
+		set_dbl(elev + c * bpe(), spill[label[c]]);
+	}
+    }
+
+    blocks_arrange(elev, nl, ns, bpe(), 0);
+    G_free(spill);
+}
+
+/* Coarse pre-solve.  Each block of f by f cells is replaced by its lowest
+ * cell and the coarse grid is priority-flooded from the blocks that hold
+ * a null or a map edge.  Any path out of a cell crosses a chain of blocks
+ * whose lowest cells are no higher than the path itself, so the coarse
+ * fill level of a block is a lower bound on the fill level of every cell
+ * in it, and cells can be raised to it before the fine passes run.  A
+ * block drains when any of its cells is on the map edge or next to a
+ * null, and blocks of nulls alone are left out. */
+
+void cflood(char *elev, int nl, int ns, struct nullmask *mask, int f)
+{
+    int bl, bs, bi, bj, i, j, k, ii, jj, edge;
+    int di[8] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+    int dj[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+    off_t b, n, c, raised;
+    double *level, v;
+    char *closed;
+    struct pq open;
+
+    bl = (nl + f - 1) / f;
+    bs = (ns + f - 1) / f;
+    level = G_malloc((off_t) bl * bs * sizeof(double));
+    closed = G_calloc((off_t) bl * bs, 1);
+
+    /* lowest cell of each block, and the blocks that drain */
+    for (b = 0; b < (off_t) bl * bs; b += 1)
+	level[b] = HUGE_VAL;
+    for (i = 0; i < nl; i += 1) {
+	for (j = nullmask_next(mask, i, 0, ns); j < ns;
+	     j = nullmask_next(mask, i, j + 1, ns)) {
+	    b = (off_t) (i / f) * bs + j / f;
+	    v = get_dbl(elev + ((off_t) i * ns + j) * bpe());
+	    if (v < level[b])
+		level[b] = v;
+	    edge = i == 0 || i == nl - 1 || j == 0 || j == ns - 1;
+	    for (k = 0; k < 8 && !edge; k += 1)
+		edge = nullmask_get(mask, i + di[k], j + dj[k]);
+	    if (edge)
+		closed[b] = 1;
+	}
+    }
+
+    pq_init(&open, bpe == bpe_c);
+    for (b = 0; b < (off_t) bl * bs; b += 1) {
+	if (level[b] == HUGE_VAL)
+	    closed[b] = 1;
+	else if (closed[b])
+	    pq_push(&open, level[b], b);
+    }
+
+    /* the level of a block is the lowest spill on its way to a drain */
+    while (pq_size(&open) > 0) {
+	b = pq_pop(&open);
+	bi = b / bs;
+	bj = b % bs;
+	for (k = 0; k < 8; k += 1) {
+	    ii = bi + di[k];
+	    jj = bj + dj[k];
+	    if (ii < 0 || ii >= bl || jj < 0 || jj >= bs)
+		continue;
+	    n = (off_t) ii * bs + jj;
+	    if (closed[n])
+		continue;
+	    closed[n] = 1;
+	    if (level[n] < level[b])
+		level[n] = level[b];
+	    pq_push(&open, level[n], n);
+	}
+    }
+    pq_free(&open);
+    G_free(closed);
+
+    raised = 0;
+#pragma omp parallel for schedule(static) private(j, c, b) reduction(+:raised)
+    for (i = 0; i < nl; i += 1) {
+	for (j = nullmask_next(mask, i, 0, ns); j < ns;
+	     j = nullmask_next(mask, i, j + 1, ns)) {
+	    c = (off_t) i * ns + j;
+	    b = (off_t) (i / f) * bs + j / f;
+	    if (level[b] > get_dbl(elev + c * bpe())) {
+		set_dbl(elev + c * bpe(), level[b]);
+		raised += 1;
+	    }
+	}
+    }
+
+    G_verbose_message(_("%ld cells raised by the coarse pre-solve"),
+		      (long)raised);
+
+    G_free(level);
+}
@@ -0,0 +1,329 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <grass/gis.h>
+#include <grass/raster.h>
+#include <grass/glocale.h>
+#include "tinf.h"
+#include "ds.h"
+#include "local.h"
+
+/* The depression hierarchy saved for later queries: the basins found
+ * before filling, each with the basin it overflows into, its own pour
+ * point, the level a full fill raises it to, its lowest cell, fill volume
+ * and bounding box, and the basin number of every cell as runs along the
+ * rows.  The basins form a forest through their next links, merging into
+ * their parents at their pour points, so a query only visits the basins it
+ * concerns and the rows they cover.  The file is written in native byte
+ * order. */
+
+#define HIER_MAGIC 0x48444652	/* "RFDH" */
+#define HIER_VERSION 2
+
+struct hier_head
+{
+    int magic;
+    int version;
+    int wrows, wcols;		/* region the hierarchy was built in */
+    int row0, col0;		/* first row and column of the labels */
+    int nrows, ncols;
+    int nbasins;
+};
+
+static void check_io(int ok, FILE *fp, const char *name)
+{
+    if (!ok) {
+	if (fp)
+	    fclose(fp);
+	G_fatal_error(_("Error accessing <%s>: %s"), name,
+		      errno ? strerror(errno) : _("file is truncated"));
+    }
+}
+
+void write_hier(const char *name, struct basin_stats *stats, int nbasins,
+		struct spans *labels, int wrows, int wcols, int row0, int col0)
+{
+    struct hier_head h;
+    struct span_row *r, whole = { 0 };
+    FILE *fp;
+    int i;
+
+    if (!(fp = fopen(name, "wb")))
+	G_fatal_error(_("Unable to open <%s> for writing: %s"), name,
+		      strerror(errno));
+
+    h.magic = HIER_MAGIC;
+    h.version = HIER_VERSION;
+    h.wrows = wrows;
+    h.wcols = wcols;
+    h.row0 = row0;
+    h.col0 = col0;
+    h.nrows = labels->nrows;
+    h.ncols = labels->ncols;
+    h.nbasins = nbasins;
+    check_io(fwrite(&h, sizeof(h), 1, fp) == 1, fp, name);
+    if (nbasins > 0)
+	check_io(fwrite(stats + 1, sizeof(struct basin_stats), nbasins, fp)
+		 == (size_t) nbasins, fp, name);
+
+    for (i = 0; i < labels->nrows; i += 1) {
+	r = labels->rows + i;
+	/* rows kept whole are written as runs all the same */
+	if (r->dense) {
+	    spans_runs(labels, i, &whole);
+	    r = &whole;
+	}
+	check_io(fwrite(&r->n, sizeof(int), 1, fp) == 1, fp, name);
+	if (r->n > 0)
+	    check_io(fwrite(r->v, sizeof(struct span), r->n, fp) ==
+		     (size_t) r->n, fp, name);
+    }
+    free(whole.v);
+
+    check_io(fclose(fp) == 0, NULL, name);
+}
+
+struct hier *read_hier(const char *name)
+{
+    struct hier_head h;
+    struct hier *t;
+    struct span_row *r;
+    FILE *fp;
+    int i;
+
+    errno = 0;
+    if (!(fp = fopen(name, "rb")))
+	G_fatal_error(_("Unable to open <%s>: %s"), name, strerror(errno));
+    check_io(fread(&h, sizeof(h), 1, fp) == 1, fp, name);
+    if (h.magic != HIER_MAGIC || h.version != HIER_VERSION)
+	G_fatal_error(_("<%s> is not a depression hierarchy of this version"),
+		      name);
+
+    t = G_malloc(sizeof(struct hier));
+    t->wrows = h.wrows;
+    t->wcols = h.wcols;
+    t->row0 = h.row0;
+    t->col0 = h.col0;
+    t->nbasins = h.nbasins;
+    t->b = G_calloc(h.nbasins + 1, sizeof(struct basin_stats));
+    if (h.nbasins > 0)
+	check_io(fread(t->b + 1, sizeof(struct basin_stats), h.nbasins, fp)
+		 == (size_t) h.nbasins, fp, name);
+
+    t->labels = spans_init(h.nrows, h.ncols);
+    for (i = 0; i < h.nrows; i += 1) {
+	r = t->labels->rows + i;
+	check_io(fread(&r->n, sizeof(int), 1, fp) == 1, fp, name);
+	if (r->n <= 0)
+	    continue;
+	r->sz = r->n;
+	r->v = (struct span *)malloc(r->n * sizeof(struct span));
+	check_io(fread(r->v, sizeof(struct span), r->n, fp) == (size_t) r->n,
+		 fp, name);
+    }
+
+    fclose(fp);
+    return t;
+}
+
+void free_hier(struct hier *t)
+{
+    spans_free(t->labels);
+    G_free(t->b);
+    G_free(t);
+}
+
+/* Copy input to output, raising the cells of the chosen basins to level
+ * when they are below it.  Rows outside every chosen basin are copied as
+ * they are. */
+static void fill_basins(struct hier *t, const char *input, const char *output,
+			double *level)
+{
+    int in_id, out_id, type, i, j, k, lo, hi;
+    struct span_row *r;
+    struct Colors colors;
+    char *buf, *cell;
+
+    in_id = Rast_open_old(input, "");
+    type = Rast_get_map_type(in_id);
+    set_func_pointers(type);
+    buf = get_buf();
+    out_id = Rast_open_new(output, type);
+
+    /* only the rows some chosen basin reaches are searched */
+    lo = t->labels->nrows;
+    hi = -1;
+    for (k = 1; k <= t->nbasins; k += 1) {
+	if (level[k] == -HUGE_VAL)
+	    continue;
+	if (t->b[k].n < lo)
+	    lo = t->b[k].n;
+	if (t->b[k].s > hi)
+	    hi = t->b[k].s;
+    }
+
+    for (i = 0; i < t->wrows; i += 1) {
+	G_percent(i, t->wrows, 5);
+	get_row(in_id, buf, i);
+	if (i - t->row0 >= lo && i - t->row0 <= hi) {
+	    r = t->labels->rows + i - t->row0;
+	    for (k = 0; k < r->n; k += 1) {
+		if (r->v[k].value <= 0 || r->v[k].value > t->nbasins ||
+		    level[r->v[k].value] == -HUGE_VAL)
+		    continue;
+		for (j = r->v[k].start; j < r->v[k].end; j += 1) {
+		    cell = buf + (t->col0 + j) * bpe();
+		    if (!is_null(cell) && get_dbl(cell) < level[r->v[k].value])
+			set_dbl(cell, level[r->v[k].value]);
+		}
+	    }
+	}
+	put_row(out_id, buf);
+    }
+    G_percent(1, 1, 1);
+
+    if (Rast_read_colors(input, "", &colors) >= 0)
+	Rast_write_colors(output, G_mapset(), &colors);
+    Rast_close(in_id);
+    Rast_close(out_id);
+    G_free(buf);
+}
+
+/* print each basin with its fill volume and the volume of every basin that
+ * overflows into it, directly or not, added in */
+static void print_volumes(struct hier *t)
+{
+    int i, k, n, *pending, *order;
+    double *total, area;
+
+    total = G_malloc((t->nbasins + 1) * sizeof(double));
+    pending = G_calloc(t->nbasins + 1, sizeof(int));
+    order = G_malloc((t->nbasins + 1) * sizeof(int));
+
+    G_begin_cell_area_calculations();
+    for (k = 1; k <= t->nbasins; k += 1) {
+	area = G_area_of_cell_at_row(t->row0 + (t->b[k].n + t->b[k].s) / 2);
+	total[k] = t->b[k].volume * area;
+	if (t->b[k].next > 0 && t->b[k].next <= t->nbasins)
+	    pending[t->b[k].next] += 1;
+    }
+
+    /* leaves first, so that each basin is complete before it is passed on */
+    n = 0;
+    for (k = 1; k <= t->nbasins; k += 1) {
+	if (pending[k] == 0)
+	    order[n++] = k;
+    }
+    for (i = 0; i < n; i += 1) {
+	k = t->b[order[i]].next;
+	if (k <= 0 || k > t->nbasins)
+	    continue;
+	total[k] += total[order[i]];
+	if (--pending[k] == 0)
+	    order[n++] = k;
+    }
+    if (n < t->nbasins)
+	G_warning(_("%d basins overflow in a loop; their totals are partial"),
+		  t->nbasins - n);
+
+    fprintf(stdout, "basin,cells,pour,spill,next,volume,total\n");
+    for (k = 1; k <= t->nbasins; k += 1) {
+	if (t->b[k].cells == 0)
+	    continue;
+	area = G_area_of_cell_at_row(t->row0 + (t->b[k].n + t->b[k].s) / 2);
+	fprintf(stdout, "%d,%ld,%.15g,%.15g,%d,%.15g,%.15g\n", k,
+		(long)t->b[k].cells, t->b[k].pour, t->b[k].spill, t->b[k].next,
+		t->b[k].volume * area, total[k]);
+    }
+
+    G_free(total);
+    G_free(pending);
+    G_free(order);
+}
+
+/* the level a query fills basin k to on its own: up to its pour point at
+ * most, or -HUGE_VAL if the query leaves it alone */
+static double own_level(struct hier *t, int k, int mode, double value)
+{
+    if (t->b[k].cells == 0)
+	return -HUGE_VAL;
+    if (mode == QUERY_LEVEL && t->b[k].bottom < value)
+	return value < t->b[k].pour ? value : t->b[k].pour;
+    if (mode == QUERY_SIZE && t->b[k].cells < value)
+	return t->b[k].pour;
+    return -HUGE_VAL;
+}
+
+/* Work out the level of every basin from the root of its tree down.  A
+ * basin that is filled only rises above its own pour point when the basin
+ * it overflows into is filled past that point too; the two are then one
+ * lake at the level of the receiving basin.  Basins that overflow in a
+ * loop are taken as roots where the loop is found. */
+static int query_levels(struct hier *t, int mode, double value, double *level)
+{
+    int k, n, p, top, nfill, *path;
+    char *state;		/* 0 not seen, 1 on the path, 2 done */
+
+    path = G_malloc((t->nbasins + 1) * sizeof(int));
+    state = G_calloc(t->nbasins + 1, 1);
+    nfill = 0;
+
+    for (k = 1; k <= t->nbasins; k += 1) {
+	/* climb to the first basin whose level is known */
+	top = 0;
+	for (n = k; n > 0 && n <= t->nbasins && state[n] == 0;
+	     n = t->b[n].next) {
+	    state[n] = 1;
+	    path[top++] = n;
+	}
+	/* and come back down, each basin after the one it overflows into */
+	while (top > 0) {
+	    n = path[--top];
+	    p = t->b[n].next;
+	    level[n] = own_level(t, n, mode, value);
+	    if (level[n] != -HUGE_VAL && p > 0 && p <= t->nbasins &&
+		state[p] == 2 && level[p] != -HUGE_VAL &&
+		level[p] > t->b[n].pour)
+		level[n] = level[p];
+	    state[n] = 2;
+	    if (level[n] != -HUGE_VAL)
+		nfill += 1;
+	}
+    }
+
+    G_free(path);
+    G_free(state);
+    return nfill;
+}
+
+/* answer a query from a saved hierarchy */
+void query_hier(const char *name, int mode, double value, const char *input,
+		const char *output)
+{
+    struct hier *t;
+    double *level;
+    int nfill;
+
+    t = read_hier(name);
+    if (t->wrows != Rast_window_rows() || t->wcols != Rast_window_cols())
+	G_fatal_error(_("<%s> was built in a region of %d rows and %d columns"),
+		      name, t->wrows, t->wcols);
+
+    if (mode == QUERY_VOLUME) {
+	print_volumes(t);
+	free_hier(t);
+	return;
+    }
+
+    /* the level each basin is filled to, -HUGE_VAL where it is left alone */
+    level = G_malloc((t->nbasins + 1) * sizeof(double));
+    nfill = query_levels(t, mode, value, level);
+    G_message(_("Filling %d of %d basins..."), nfill, t->nbasins);
+
+    fill_basins(t, input, output, level);
+
+    G_free(level);
+    free_hier(t);
+}
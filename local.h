@@ -1,5 +1,83 @@
-void filldir(char*, char*, int, struct band3 *);
-void resolve(char*, int, struct band3 *);
-int dopolys(char*, char*, int, int);
-void wtrshed(char*, char*, int, int, int);
-void ppupdate(char*, char*, int, int, struct band3 *, struct band3 *);
+/* per-basin spill statistics gathered by ppupdate() */
+struct basin_stats
+{
+    off_t cells;		/* number of cells in the basin */
+    int next;			/* basin receiving the overflow, -1 if none */
+    double pour;		/* lowest barrier to the next basin */
+    double spill;		/* level it is filled to, after the basins */
+				/* it overflows into are filled */
+    double volume;		/* sum of fill depths over the basin */
+    double bottom;		/* lowest cell before filling */
+    int n, s, w, e;		/* bounding rows and columns */
+};
+
+/* a depression hierarchy read back from a file */
+struct hier
+{
+    int wrows, wcols;
+    int row0, col0;
+    int nbasins;
+    struct basin_stats *b;	/* 1 to nbasins */
+    struct spans *labels;	/* basin numbers of the cells */
+};
+
+#define QUERY_LEVEL 1		/* fill to a level */
+#define QUERY_SIZE 2		/* fill basins of fewer cells */
+#define QUERY_VOLUME 3		/* report volumes */
+
+#define NUMA_NONE 0
+#define NUMA_INTERLEAVE 1	/* pages spread over all nodes */
+#define NUMA_BANDS 2		/* rows first written by their threads */
+
+/* edges between the labels of a priority-flood, weighted by the lower
+ * of the two possible spill elevations */
+#define OCEAN 1			/* label of the cells that drain the map */
+
+struct sedge
+{
+    CELL a;
+    CELL b;
+    double w;
+};
+
+struct sgraph
+{
+    struct sedge *v;
+    size_t n;
+    size_t sz;
+};
+
+void eflood(char *, int, int, struct nullmask *);
+void pflood(char *, char *, int, int, struct nullmask *, int);
+void add_edge(struct sgraph *, CELL, CELL, double);
+CELL flood_tile(char *, CELL *, int, int, int, int, CELL, struct nullmask *,
+		struct sgraph *, int);
+double *solve_spill(struct sgraph *, int, CELL);
+void cflood(char *, int, int, struct nullmask *, int);
+void filldir(char*, struct rows *, int, struct band3 *, struct nullmask *);
+void resolve(struct rows *, int, struct band3 *, struct nullmask *, off_t);
+int dopolys(struct rows *, struct spans *, int, int, struct nullmask *);
+off_t wtrshed_size(int, int);
+void wtrshed(struct spans *, struct rows *, int, int, off_t);
+void ppupdate(char*, struct spans *, int, int, struct band3 *, struct band3 *,
+	      struct nullmask *, struct basin_stats *);
+void write_stats(char*, struct basin_stats *, int, int, int,
+		 struct Cell_head *);
+void write_bil(const char *, const char *, const void *, int, int, int, int,
+	       struct Cell_head *, int, int);
+void write_bil_rows(const char *, const char *, struct rows *, int, int,
+		    struct Cell_head *, int, int);
+void write_bil_wide(const char *, const char *, const void *, int, int, int,
+		    double, struct Cell_head *, int, int);
+void widen_row(DCELL *, const void *, int, int, double);
+void write_hier(const char *, struct basin_stats *, int, struct spans *, int,
+		int, int, int);
+struct hier *read_hier(const char *);
+void free_hier(struct hier *);
+void query_hier(const char *, int, double, const char *, const char *);
+void numa_place(char *, int, off_t, int);
+void numa_pin(void);
+void tile_flood(const char *, const char *, const char *);
+void tile_merge(char **, int);
+void tile_apply(const char *, const char *, const char *);
+void serve(const char *, const char *, const CELL *, int, int, int, int);
@@ -38,6 +38,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
 #include <sys/mman.h>
 
 /* for using the "open" statement */
@@ -49,167 +50,372 @@
 #include <unistd.h>
 #include <errno.h>
 
+/* for the batch workers */
+#include <sys/wait.h>
+#include <time.h>
+
 #include <grass/gis.h>
 #include <grass/raster.h>
 #include <grass/glocale.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
 #define DEBUG
 #include "tinf.h"
+#include "ds.h"
 #include "local.h"
 
 static int dir_type(int type, int dir);
 
-int allocate(char** elev, off_t elevsize, char** dirs, off_t dirsize, 
-    char** prob, off_t probsize, struct Flag* flag) {
-         G_verbose_message(_("%ld %ld %ld"), elevsize, dirsize, probsize);
+/* where the map buffers live */
+#define MEM_RAM 0
+#define MEM_MAPPED 1
+#define MEM_FILE 2
+
+/* Get a buffer in RAM, in an anonymous mapping or in a mapping of an
+ * unlinked temporary file. Pages of a file mapping that are not being used
+ * are written out and dropped by the kernel, so the buffer can be larger
+ * than the memory available. */
+char* allocate(off_t size, int mode, const char* what) {
+    char* buf;
+    char* name;
+    int fd;
 
-    if(flag->answer) {
-        if(MAP_FAILED == (*elev = (char*) mmap(NULL, elevsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, 0, 0))) {
-            G_important_message(_("Failed to map memory for filled: %s"), strerror(errno));
-            return 0;
+    switch(mode) {
+    case MEM_MAPPED:
+        if(MAP_FAILED == (buf = (char*) mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, 0, 0))) {
+            G_important_message(_("Failed to map memory for %s: %s"), what, strerror(errno));
+            return NULL;
         }
-        if(MAP_FAILED == (*dirs = (char*) mmap(NULL, dirsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, 0, 0))) {
-            G_important_message(_("Failed to map memory for directions: %s"), strerror(errno));
-            return 0;
+        break;
+    case MEM_FILE:
+        name = G_tempfile();
+        if((fd = open(name, O_RDWR|O_CREAT|O_EXCL, 0600)) < 0) {
+            G_important_message(_("Failed to create temporary file for %s: %s"), what, strerror(errno));
+            G_free(name);
+            return NULL;
         }
-        if(MAP_FAILED == (*prob = (char*) mmap(NULL, probsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, 0, 0))) {
-            G_important_message(_("Failed to map memory for problems: %s"), strerror(errno));
-            return 0;
+        unlink(name);
+        G_free(name);
+        if(ftruncate(fd, size) || MAP_FAILED == (buf = (char*) mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0))) {
+            G_important_message(_("Failed to map temporary file for %s: %s"), what, strerror(errno));
+            close(fd);
+            return NULL;
         }
-    } else {
-        if(!(*elev = (char*) malloc(elevsize))) {
-            G_important_message(_("Failed to allocate memory for filled: %s"), strerror(errno));
-            return 0;
+        close(fd);
+        /* the stages sweep the buffers a row at a time */
+        madvise(buf, size, MADV_SEQUENTIAL);
+        break;
+    default:
+        if(!(buf = (char*) malloc(size))) {
+            G_important_message(_("Failed to allocate memory for %s: %s"), what, strerror(errno));
+            return NULL;
         }
-        if(!(*dirs = (char*) malloc(dirsize))) {
-            G_important_message(_("Failed to allocate memory for directions: %s"), strerror(errno));
-            return 0;
+    }
+    return buf;
+}
+
+void deallocate(char* buf, off_t size, int mode) {
+    if(mode == MEM_RAM)
+        free(buf);
+    else
+        munmap(buf, size);
+}
+
+/* one map to fill, from the command line or a line of the batch file */
+struct job
+{
+    char *input;
+    char *output;
+    char *direction;
+    char *areas;
+    char *stats;
+    char *raw;
+    char *rawin;
+    char *hierarchy;
+};
+
+/* settings shared by every map */
+struct settings
+{
+    int type;			/* direction format */
+    int find_only;		/* -f */
+    int mapped;			/* -m */
+    int gradient;		/* -e */
+    int parallel;		/* -p */
+    int own_region;		/* batch maps are filled in their own region */
+    int timing;			/* -t */
+    int raw_only;		/* -r */
+    int compress;		/* -z */
+    int rawtype;		/* cell type of rawin= */
+    int has_nodata;
+    double nodata;		/* value of null cells in rawin= */
+    int coarse;			/* block size of the pre-solve, 0 for none */
+    int precision;		/* cell type DCELL maps are held in */
+    double resolution;		/* elevation step of precision=int */
+    int nprocs;
+    int numa;			/* NUMA_* placement of the buffers */
+    off_t budget;		/* memory= in bytes, 0 if not given */
+};
+
+/* map buffers kept from one map to the next */
+struct buffers
+{
+    char *elev;
+    off_t elevsize;
+    int elevmode;
+    char *dirs;
+    off_t dirsize;
+    int dirsmode;
+};
+
+static double now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* With -t, report the time since the last stage ended, so that a change
+ * to one stage can be compared with an earlier build. */
+static void stage_done(struct settings *set, double *t, const char *stage)
+{
+    double t1;
+
+    if (!set->timing)
+	return;
+    t1 = now();
+    G_message(_("%s: %.3f seconds"), stage, t1 - *t);
+    *t = t1;
+}
+
+/* 64-bit FNV-1a hash of the rows written, to check that the outputs of a
+ * changed build still match */
+static uint64_t checksum(uint64_t h, const void *buf, size_t sz)
+{
+    const unsigned char *p = buf;
+
+    while (sz--) {
+	h ^= *p++;
+	h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define CHECKSUM_INIT 0xcbf29ce484222325ULL
+
+/* reuse a buffer when it is big enough and lives in the same place */
+static char *reserve(char *old, off_t *oldsize, int *oldmode, off_t size,
+                     int mode, const char *what)
+{
+    char *buf;
+
+    if (old != NULL && *oldsize >= size && *oldmode == mode)
+        return old;
+    if (old != NULL)
+        deallocate(old, *oldsize, *oldmode);
+    if ((buf = allocate(size, mode, what)) != NULL) {
+        *oldsize = size;
+        *oldmode = mode;
+    }
+    return buf;
+}
+
+/* Recode directions through a table of dir_type() for the codes 0 to 255;
+ * flats, pits and nulls are outside it and are left alone. Compressed
+ * rows are recoded one at a time. */
+static void encode_dirs(const CELL *table, struct rows *dirs, int nrows, int ncols)
+{
+    off_t k, n;
+    CELL *dir;
+    int i, j;
+
+    if (dirs->buf != NULL) {
+        dir = (CELL *) dirs->buf;
+        n = (off_t) nrows * ncols;
+#pragma omp parallel for schedule(static) if (n > 65536)
+        for (k = 0; k < n; k += 1) {
+            if ((unsigned int) dir[k] < 256)
+                dir[k] = table[dir[k]];
         }
-        if(!(*prob = (char*) malloc(probsize))) {
-            G_important_message(_("Failed to allocate memory for problems: %s"), strerror(errno));            
-            return 0;
+        return;
+    }
+
+    dir = G_malloc(ncols * sizeof(CELL));
+    for (i = 0; i < nrows; i += 1) {
+        rows_get(dirs, i, dir);
+        for (j = 0; j < ncols; j += 1) {
+            if ((unsigned int) dir[j] < 256)
+                dir[j] = table[dir[j]];
         }
+        rows_put(dirs, i, dir);
     }
-    return 1;
+    G_free(dir);
 }
 
-void deallocate(char* elev, off_t elevsize, char* dirs, off_t dirsize, 
-    char* prob, off_t probsize, struct Flag* flag) {
-    if(flag->answer) {
-        munmap(elev, elevsize);
-        munmap(dirs, dirsize);
-        munmap(prob, probsize);
-    } else {
-        free(elev);
-        free(dirs);
-        free(prob);
-    }
+/* Map a raw grid of the region's size, copy on write, for use as the
+ * elevation buffer. Pages are read in when they are first touched and
+ * changes never reach the file. */
+static char *map_raw(const char *name, off_t size)
+{
+    struct stat st;
+    char *buf;
+    int fd;
+    union {
+        int i;
+        char c;
+    } order;
+
+    order.i = 1;
+    if (!order.c)
+        G_fatal_error(_("Raw input is little-endian and this machine is not"));
+
+    if ((fd = open(name, O_RDONLY)) < 0)
+        G_fatal_error(_("Unable to open <%s>: %s"), name, strerror(errno));
+    if (fstat(fd, &st) != 0)
+        G_fatal_error(_("Unable to read <%s>: %s"), name, strerror(errno));
+    if (st.st_size != size)
+        G_fatal_error(_("<%s> has %ld bytes, but the region needs %ld"), name,
+                      (long) st.st_size, (long) size);
+    if (MAP_FAILED == (buf = (char*) mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0)))
+        G_fatal_error(_("Unable to map <%s>: %s"), name, strerror(errno));
+    close(fd);
+    madvise(buf, size, MADV_SEQUENTIAL);
+    return buf;
 }
 
-int main(int argc, char **argv)
+/* Store an elevation in a cell of a narrower type and return the value it
+ * will be widened back to. Integers count steps of res. */
+static double narrow(void *cell, DCELL d, int type, double res)
 {
+    DCELL back;
 
-    int i, j, type;
+    if (type == FCELL_TYPE) {
+        *(FCELL *) cell = (FCELL) d;
+        return *(FCELL *) cell;
+    }
+    if (fabs(d / res) >= INT_MAX)
+        G_fatal_error(_("Elevation %g does not fit in 32 bits at resolution %g"), d, res);
+    *(CELL *) cell = (CELL) floor(d / res + 0.5);
+    widen_row(&back, cell, 1, type, res);
+    return back;
+}
+
+/* fill one map; returns 0 on success */
+static int fill_map(struct job *job, struct settings *set, struct buffers *buf)
+{
+    int i, j;
     int new_id;
     int nrows, ncols, nbasins;
-    int map_id, dir_id, bas_id;
-    char map_name[GNAME_MAX], new_map_name[GNAME_MAX];
-    char dir_name[GNAME_MAX];
-    char bas_name[GNAME_MAX];
-
+    int wrows, wcols, row0, row1, col0, col1;
+    int map_id = -1, dir_id, bas_id = -1;
     struct Cell_head window;
-    struct GModule *module;
-    struct Option *opt1, *opt2, *opt3, *opt4, *opt5;
-    struct Flag *flag1, *flag2;
-    int in_type, bufsz;
+    int in_type, work_type, lossy;
+    double res, err, maxerr;
+    DCELL *wide_buf;
+    char *null_flags;
     void *in_buf;
-    CELL *out_buf;
+    CELL *out_buf, *bas_buf = NULL;
+    CELL dir_table[256];
     struct band3 bnd, bndC;
     struct Colors colors; 
+    struct basin_stats *stats;
+    struct nullmask *mask;
+    uint64_t sum_elev, sum_dir, sum_bas;
+    double t;
 
-    // Initialize the GRASS environment variables.
-    G_gisinit(argv[0]);
+    t = now();
 
-    module = G_define_module();
-    G_add_keyword(_("raster"));
-    G_add_keyword(_("hydrology"));
-    G_add_keyword(_("sink"));
-    G_add_keyword(_("fill sinks"));
-    G_add_keyword(_("depressions"));
-    module->description = _("Filters and generates a depressionless elevation map and a "
-        "flow direction map from a given elevation raster map.");
-    
-    opt1 = G_define_standard_option(G_OPT_R_ELEV);
-    opt1->key = "input";
-    
-    opt2 = G_define_standard_option(G_OPT_R_OUTPUT);
-    opt2->description = _("Name for output depressionless elevation raster map");
-    
-    opt4 = G_define_standard_option(G_OPT_R_OUTPUT);
-    opt4->key = "direction";
-    opt4->description = _("Name for output flow direction map for depressionless elevation raster map");
+    if (set->find_only && job->areas == NULL)
+    	G_fatal_error(_("The '%c' flag requires '%s'to be specified"), 'f', "areas");
 
-    opt5 = G_define_standard_option(G_OPT_R_OUTPUT);
-    opt5->key = "areas";
-    opt5->required = NO;
-    opt5->description = _("Name for output raster map of problem areas");
+    if (set->find_only && job->stats != NULL)
+    	G_fatal_error(_("The '%c' flag cannot be used with '%s'"), 'f', "stats");
 
-    opt3 = G_define_option();
-    opt3->key = "format";
-    opt3->type = TYPE_STRING;
-    opt3->required = NO;
-    opt3->description = _("Aspect direction format");
-    opt3->options = "agnps,answers,grass";
-    opt3->answer = "grass";
-    
-    flag1 = G_define_flag();
-    flag1->key = 'f';
-    flag1->description = _("Find unresolved areas only");
-    
-    flag2 = G_define_flag();
-    flag2->key = 'm';
-    flag2->description = _("Use mapped memory");
-    
-    if (G_parser(argc, argv))
-	   exit(EXIT_FAILURE);
+    // Tiles of a batch each cover their own extent.
+    if (set->own_region) {
+        Rast_get_cellhd(job->input, "", &window);
+        Rast_set_window(&window);
+    }
 
-    if (flag1->answer && opt5->answer == NULL)
-    	G_fatal_error(_("The '%c' flag requires '%s'to be specified"), flag1->key, opt5->key);
+    // Open the maps and get their file ids. A raw grid has no colors.
+    if (job->rawin == NULL) {
+        map_id = Rast_open_old(job->input, "");
+        if (Rast_read_colors(job->input, "", &colors) < 0)
+            G_warning(_("Unable to read color table for raster map <%s>"), job->input);
 
-    type = 0;
-    strcpy(map_name, opt1->answer);
-    strcpy(new_map_name, opt2->answer);
-    strcpy(dir_name, opt4->answer);
-    if (opt5->answer != NULL)
-	   strcpy(bas_name, opt5->answer);
+        // Allocate cell buf for the map layer.
+        in_type = Rast_get_map_type(map_id);
+    } else
+        in_type = set->rawtype;
 
-    if (strcmp(opt3->answer, "agnps") == 0)
-	   type = 1;
-    else if (strcmp(opt3->answer, "answers") == 0)
-	   type = 2;
-    else if (strcmp(opt3->answer, "grass") == 0)
-	   type = 3;
-    
-    G_debug(1, "output type (1=AGNPS, 2=ANSWERS, 3=GRASS): %d", type);
-
-    if (type == 3)
-	   G_verbose_message(_("Direction map is D8 resolution, i.e. 45 degrees"));
-    
-    // Open the maps and get their file ids.
-    map_id = Rast_open_old(map_name, "");
-    if (Rast_read_colors(map_name, "", &colors) < 0)
-        G_warning(_("Unable to read color table for raster map <%s>"), map_name);
-    
-    // Allocate cell buf for the map layer.
-    in_type = Rast_get_map_type(map_id);
+    // DCELL maps may be held in fewer bits and widened again on output.
+    work_type = in_type;
+    res = 1.;
+    if (in_type == DCELL_TYPE && job->rawin == NULL && set->precision != DCELL_TYPE) {
+        work_type = set->precision;
+        res = set->resolution;
+    }
 
     // Set the pointers for multi-typed functions.
-    set_func_pointers(in_type);
+    set_func_pointers(work_type);
 
     // Get the window information.
     G_get_window(&window);
-    nrows = Rast_window_rows();
-    ncols = Rast_window_cols();
+    wrows = Rast_window_rows();
+    wcols = Rast_window_cols();
+
+    // Find the rows and columns that hold data. The null margins around
+    // them are neither stored nor processed. A raw grid is used in place,
+    // so it is not cropped.
+    row0 = col0 = 0;
+    row1 = wrows - 1;
+    col1 = wcols - 1;
+    if (job->rawin == NULL) {
+        G_message(_("Finding the extent of the data..."));
+        row0 = wrows;
+        row1 = -1;
+        col0 = wcols;
+        col1 = -1;
+        null_flags = G_malloc(wcols);
+        for (i = 0; i < wrows; i++) {
+            G_percent(i, wrows, 2);
+            Rast_get_null_value_row(map_id, null_flags, i);
+            for (j = 0; j < wcols && null_flags[j]; j++)
+                ;
+            if (j == wcols)
+                continue;
+            if (i < row0)
+                row0 = i;
+            row1 = i;
+            if (j < col0)
+                col0 = j;
+            for (j = wcols - 1; null_flags[j]; j--)
+                ;
+            if (j > col1)
+                col1 = j;
+        }
+        G_percent(1, 1, 1);
+        G_free(null_flags);
+    }
+
+    // Keep a border of one null cell so that the data drains into it as it
+    // would in the full region. Tiny or empty extents are not cropped.
+    row0 = row0 > 0 ? row0 - 1 : 0;
+    row1 = row1 < wrows - 1 ? row1 + 1 : wrows - 1;
+    col0 = col0 > 0 ? col0 - 1 : 0;
+    col1 = col1 < wcols - 1 ? col1 + 1 : wcols - 1;
+    if (row1 - row0 < 2 || col1 - col0 < 2) {
+        row0 = col0 = 0;
+        row1 = wrows - 1;
+        col1 = wcols - 1;
+    }
+    nrows = row1 - row0 + 1;
+    ncols = col1 - col0 + 1;
+    if (nrows < wrows || ncols < wcols)
+        G_verbose_message(_("Processing %d rows and %d columns of %d by %d"), nrows, ncols, wrows, wcols);
 
     // Buffers for internal use.
     bndC.ns = ncols;
@@ -230,67 +436,256 @@ int main(int argc, char **argv)
     int mb = 1024 * 1024;
 
     // The size of the memory mappings. Must be rounded up to the nearest page boundary.
-    off_t mapsize = nrows * ncols;
+    off_t mapsize = (off_t) nrows * ncols;
     off_t elevsize = ((mapsize * bpe()) / sysconf(_SC_PAGE_SIZE) + 1) * sysconf(_SC_PAGE_SIZE);
     off_t dirsize = ((mapsize * sizeof(CELL)) / sysconf(_SC_PAGE_SIZE) + 1) * sysconf(_SC_PAGE_SIZE);
-    off_t probsize = ((mapsize * sizeof(CELL)) / sysconf(_SC_PAGE_SIZE) + 1) * sysconf(_SC_PAGE_SIZE);
-    G_verbose_message(_("Memory allocations: elev: %ldMB; dirs: %ldMB; probs: %ldMB"), elevsize / mb, dirsize / mb, probsize / mb);
+    off_t masksize = (off_t) nrows * ((ncols + 63) / 64) * sizeof(uint64_t);
+    G_verbose_message(_("Memory allocations: elev: %ldMB; dirs: %ldMB"), elevsize / mb, dirsize / mb);
+
+    // The map buffers and null mask, plus the most any one stage holds on
+    // its own. A byte per cell for the -e flood and a label per cell for the
+    // -p flood, when the directions are compressed and cannot lend it their
+    // buffer, are needed. The offsets the watersheds are followed with are
+    // only used when they fit, and the rows are swept otherwise. The lists
+    // of flat cells are given as much as the directions take, and are made
+    // for fewer rows at a time when the flats need more. The problem areas
+    // and compressed directions are counted at their worst, as rows and
+    // blocks that do not shrink are kept as they are. Neither can be paged,
+    // so -z is given up when it would not fit in the budget.
+    off_t fixed = masksize + 3 * (bnd.sz + bndC.sz) + spans_max_bytes(nrows, ncols);
+    off_t zdirs = zrows_max_bytes(nrows, ncols);
+    off_t labels = set->parallel ? mapsize * (off_t) sizeof(CELL) : 0;
+    int compress = set->compress;
+    if (compress && set->budget > 0 && fixed + zdirs + labels > set->budget) {
+        G_important_message(_("Compressed directions may take %ldMB, more than <%s> leaves; keeping them uncompressed."),
+                            (long) ((zdirs + mb - 1) / mb), "memory");
+        compress = 0;
+    }
+    off_t dirsheld = compress ? 0 : dirsize;
+    if (compress)
+        fixed += zdirs;
+    else
+        labels = 0;
+    off_t must = labels;
+    if (set->gradient && mapsize > must)
+        must = mapsize;
+    off_t stage = must;
+    if (mapsize * (off_t) sizeof(CELL) > stage)
+        stage = mapsize * sizeof(CELL);
+    if (!set->find_only && wtrshed_size(nrows, ncols) > stage)
+        stage = wtrshed_size(nrows, ncols);
+    off_t peak = elevsize + dirsheld + fixed + stage;
+    G_message(_("Predicted peak memory use: %ldMB"), (long) ((peak + mb - 1) / mb));
 
     // Pointers to memory (mapped or malloced). Replaces the file handles used in the original.
     char* elev;
     char* dirs;
-    char* prob;
+    struct rows drows;
+    struct spans* prob;
 
     // Pointers to the mapped memory. These can be moved, the original pointers should not be.
     char* elevbuf;
-    char* dirsbuf;
-    char* probbuf;
 
-    if(flag2->answer) {
+    // Keep what fits in the budget in memory, elevation first, and page the
+    // rest through temporary files. The stages get what is left.
+    int elevmode, dirsmode;
+    off_t budget = set->budget > 0 ? set->budget : peak;
+    budget -= fixed + must;
+    elevmode = elevsize <= budget ? (set->mapped ? MEM_MAPPED : MEM_RAM) : MEM_FILE;
+    if (elevmode != MEM_FILE)
+        budget -= elevsize;
+    dirsmode = dirsheld <= budget ? (set->mapped ? MEM_MAPPED : MEM_RAM) : MEM_FILE;
+    if (dirsmode != MEM_FILE)
+        budget -= dirsheld;
+    off_t limit = must + (budget > 0 ? budget : 0);
+
+    if (elevmode == MEM_FILE || dirsmode == MEM_FILE) {
+        G_important_message(_("Paging buffers through temporary files to stay within %ldMB."), (long) (set->budget / mb));
+    } else if(set->mapped) {
         G_important_message(_("Using mapped memory."));
     } else {
         G_important_message(_("Using physical RAM."));
     }
 
-    if(!allocate(&elev, elevsize, &dirs, dirsize, &prob, probsize, flag2)) {
-        G_important_message(_("Failed to allocate memory. Try using mapped?"));
+    // Buffers left from an earlier map of the batch are used again when
+    // they are big enough.
+    if (job->rawin != NULL)
+        elev = map_raw(job->rawin, mapsize * bpe());
+    else if (!(buf->elev = elev = reserve(buf->elev, &buf->elevsize, &buf->elevmode, elevsize, elevmode, _("filled")))) {
+        G_important_message(_("Failed to allocate memory. Try setting <%s>."), "memory");
+        return 1;
+    }
+    drows.z = NULL;
+    if (compress) {
+        dirs = NULL;
+        drows.z = zrows_init(nrows, ncols);
+    } else if(
+       !(buf->dirs = dirs = reserve(buf->dirs, &buf->dirsize, &buf->dirsmode, dirsize, dirsmode, _("directions")))) {
+        G_important_message(_("Failed to allocate memory. Try setting <%s>."), "memory");
         return 1;
     };
+    drows.buf = dirs;
+    drows.sz = bndC.sz;
 
-    // Copy the source image into the mapped buffer.
-    G_message(_("Reading input elevation raster map..."));
-    for (i = 0; i < nrows; i++) {
-	   G_percent(i, nrows, 2);
-	   get_row(map_id, in_buf, i);
-       memcpy(elev + i * bnd.sz, in_buf, bnd.sz);
+    // Spread the buffers over the memory nodes before the read loop
+    // touches them. Pages of temporary files stay where the cache has them.
+    if (set->numa != NUMA_NONE) {
+        numa_pin();
+        if (job->rawin == NULL && elevmode != MEM_FILE)
+            numa_place(elev, nrows, bnd.sz, set->numa);
+        if (dirs != NULL && dirsmode != MEM_FILE)
+            numa_place(dirs, nrows, bndC.sz, set->numa);
+    }
+
+    prob = spans_init(nrows, ncols);
+
+    // Null cells never change, so they are recorded once for all stages.
+    mask = nullmask_init(nrows, ncols);
+
+    // Copy the source image into the mapped buffer. A raw grid is already
+    // in place and only needs its no-data cells made null.
+    if (job->rawin != NULL) {
+        G_message(_("Scanning raw input <%s>..."), job->rawin);
+        for (i = 0; i < nrows; i++) {
+           G_percent(i, nrows, 2);
+           for (j = 0; j < ncols; j++) {
+               elevbuf = elev + (off_t) i * bnd.sz + j * bpe();
+               if (set->has_nodata && get_dbl(elevbuf) == set->nodata)
+                   Rast_set_null_value(elevbuf, 1, work_type);
+               if (is_null(elevbuf))
+                   nullmask_set(mask, i, j);
+           }
+        }
+        G_percent(1, 1, 1);
+    } else if (work_type != in_type) {
+        G_message(_("Reading input elevation raster map at reduced precision..."));
+        wide_buf = Rast_allocate_d_buf();
+        lossy = 0;
+        maxerr = 0.;
+        for (i = 0; i < nrows; i++) {
+           G_percent(i, nrows, 2);
+           Rast_get_d_row(map_id, wide_buf, row0 + i);
+           for (j = 0; j < ncols; j++) {
+               elevbuf = elev + (off_t) i * bnd.sz + j * bpe();
+               if (Rast_is_d_null_value(wide_buf + col0 + j)) {
+                   Rast_set_null_value(elevbuf, 1, work_type);
+                   nullmask_set(mask, i, j);
+                   continue;
+               }
+               err = fabs(narrow(elevbuf, wide_buf[col0 + j], work_type, res) - wide_buf[col0 + j]);
+               if (err > maxerr)
+                   maxerr = err;
+               // integers must hit the data exactly, floats within half a step
+               if (err > (work_type == CELL_TYPE ? 1e-3 * res : res / 2))
+                   lossy += 1;
+           }
+        }
+        G_percent(1, 1, 1);
+        G_free(wide_buf);
+        Rast_close(map_id);
+        if (lossy > 0 && (work_type == CELL_TYPE || res > 0))
+            G_warning(_("%d cells lost precision, by up to %g"), lossy, maxerr);
+        else
+            G_verbose_message(_("Largest change from reduced precision: %g"), maxerr);
+    } else {
+        G_message(_("Reading input elevation raster map..."));
+        for (i = 0; i < nrows; i++) {
+    	   G_percent(i, nrows, 2);
+    	   get_row(map_id, in_buf, row0 + i);
+           memcpy(elev + (off_t) i * bnd.sz, (char *) in_buf + col0 * bpe(), bnd.sz);
+           for (j = 0; j < ncols; j++) {
+               if (is_null(elev + (off_t) i * bnd.sz + j * bpe()))
+                   nullmask_set(mask, i, j);
+           }
+        }
+        G_percent(1, 1, 1);
+        Rast_close(map_id);
+    }
+    stage_done(set, &t, _("Reading"));
+
+    // Raise the cells of large depressions to a lower bound of their fill
+    // level found on a coarse grid, leaving the fine passes local work.
+    if (set->coarse > 1) {
+        G_message(_("Pre-solving depressions on blocks of %d cells..."), set->coarse);
+        cflood(elev, nrows, ncols, mask, set->coarse);
+        stage_done(set, &t, _("Coarse pre-solve"));
+    }
+
+    // Raise every depression and flat so that the rest has nothing to fill.
+    if (set->gradient) {
+        G_message(_("Flooding depressions with a gradient toward the outlets..."));
+        eflood(elev, nrows, ncols, mask);
+        stage_done(set, &t, _("Gradient flood"));
+    }
+
+    // Raise every depression to its spill level, one strip per thread. The
+    // labels of the flood need a whole buffer while it runs.
+    if (set->parallel) {
+        G_message(_("Flooding depressions..."));
+        if (dirs != NULL)
+            pflood(elev, dirs, nrows, ncols, mask, set->nprocs);
+        else {
+            char *labels = G_malloc(mapsize * sizeof(CELL));
+            pflood(elev, labels, nrows, ncols, mask, set->nprocs);
+            G_free(labels);
+        }
+        stage_done(set, &t, _("Parallel flood"));
     }
-    G_percent(1, 1, 1);
-    Rast_close(map_id);
 
     // Fill single-cell holes and take a first stab at flow directions.
     G_message(_("Filling sinks..."));
-    filldir(elev, dirs, nrows, &bnd);
+    filldir(elev, &drows, nrows, &bnd, mask);
+    stage_done(set, &t, _("Sinks"));
 
     // Determine flow directions for ambiguous cases.
     G_message(_("Determining flow directions for ambiguous cases..."));
-    resolve(dirs, nrows, &bndC);
+    resolve(&drows, nrows, &bndC, mask, limit);
+    stage_done(set, &t, _("Flats"));
 
     // Mark and count the sinks in each internally drained basin.
-    nbasins = dopolys(dirs, prob, nrows, ncols);
-    if (!flag1->answer) {
+    nbasins = dopolys(&drows, prob, nrows, ncols, mask);
+    stage_done(set, &t, _("Problem areas"));
+    if (!set->find_only && nbasins > 0) {
     	// Determine the watershed for each sink.
         G_message(_("Determining watershed for each sink..."));
-    	wtrshed(prob, dirs, nrows, ncols, 4);
+    	wtrshed(prob, &drows, nrows, ncols, limit);
+        stage_done(set, &t, _("Watersheds"));
 
     	// Fill all of the watersheds up to the elevation necessary for drainage.
     	G_message(_("Filling watersheds..."));
-        ppupdate(elev, prob, nrows, nbasins, &bnd, &bndC);
+        stats = NULL;
+        if (job->stats != NULL || job->hierarchy != NULL)
+            stats = G_calloc(nbasins + 1, sizeof(struct basin_stats));
+        ppupdate(elev, prob, nrows, nbasins, &bnd, &bndC, mask, stats);
+        if (stats != NULL) {
+            // spill levels and volumes are in steps of res
+            for (i = 1; work_type == CELL_TYPE && i <= nbasins; i++) {
+                stats[i].pour *= res;
+                stats[i].spill *= res;
+                stats[i].volume *= res;
+                stats[i].bottom *= res;
+            }
+            if (job->stats != NULL)
+                write_stats(job->stats, stats, nbasins, row0, col0, &window);
+            // The basin numbers are still those found before filling.
+            if (job->hierarchy != NULL)
+                write_hier(job->hierarchy, stats, nbasins, prob, wrows, wcols, row0, col0);
+            G_free(stats);
+        }
+        stage_done(set, &t, _("Filling watersheds"));
 
     	// Repeat the first three steps to get the final directions.
     	G_message(_("Repeat to get the final directions..."));
-    	filldir(elev, dirs, nrows, &bnd);
-    	resolve(dirs, nrows, &bndC);
-    	nbasins = dopolys(dirs, prob, nrows, ncols);
+    	filldir(elev, &drows, nrows, &bnd, mask);
+    	resolve(&drows, nrows, &bndC, mask, limit);
+    	nbasins = dopolys(&drows, prob, nrows, ncols, mask);
+        stage_done(set, &t, _("Final directions"));
+    } else if (!set->find_only) {
+        // Nothing needed filling; the table only has its header.
+        if (job->stats != NULL)
+            write_stats(job->stats, NULL, 0, row0, col0, &window);
+        if (job->hierarchy != NULL)
+            write_hier(job->hierarchy, NULL, 0, prob, wrows, wcols, row0, col0);
     }
 
     G_free(bndC.b[0]);
@@ -301,60 +696,643 @@ int main(int argc, char **argv)
     G_free(bnd.b[1]);
     G_free(bnd.b[2]);
 
-    G_important_message(_("Writing output raster maps..."));
+    nullmask_free(mask);
+
+    // Put the directions into the output format once, in place, for both
+    // the raster map and the raw file.
+    for (j = 0; j < 256; j += 1)
+        dir_table[j] = dir_type(set->type, j);
+    encode_dirs(dir_table, &drows, nrows, ncols);
 
     out_buf = Rast_allocate_c_buf();
-    bufsz = ncols * sizeof(CELL);
-
-    // Reset the elevations buffer position.
-    elevbuf = elev;
-    new_id = Rast_open_new(new_map_name, in_type);
-
-    // Reset the directions buffer position.
-    dirsbuf = dirs;
-    dir_id = Rast_open_new(dir_name, CELL_TYPE);
-
-    // Write problem areas to a file.
-    if (opt5->answer != NULL) {
-        G_important_message(_("Writing problem map..."));
-        probbuf = prob;
-    	bas_id = Rast_open_new(bas_name, CELL_TYPE);
-    	for (i = 0; i < nrows; i++) {
-            memcpy(out_buf, probbuf, bufsz);
-            probbuf += bufsz;
-    	    Rast_put_row(bas_id, out_buf, CELL_TYPE);
-    	}
-    	Rast_close(bas_id);
-    }
-
-    G_important_message(_("Writing filled and directions maps..."));
-    for (i = 0; i < nrows; i++) {
-        G_percent(i, nrows, 5);
-        
-        memcpy(in_buf, elevbuf, bnd.sz);
-        elevbuf += bnd.sz;
-        put_row(new_id, in_buf);
-
-        memcpy(out_buf, dirsbuf, bufsz);
-        dirsbuf += bufsz;
-        for (j = 0; j < ncols; j += 1)
-    	   out_buf[j] = dir_type(type, out_buf[j]);
-    	Rast_put_row(dir_id, out_buf, CELL_TYPE);
-    }
-    G_percent(1, 1, 1);
-
-    // Copy color table from input.
-    Rast_write_colors(new_map_name, G_mapset(), &colors);
-
-    // Close up the rasters and unmap the memory.
-    Rast_close(new_id);    
-    Rast_close(dir_id);
-
-    deallocate(elev, elevsize, dirs, dirsize, prob, probsize, flag2);
+    sum_elev = sum_dir = sum_bas = CHECKSUM_INIT;
+
+    if (!set->raw_only) {
+        G_important_message(_("Writing output raster maps..."));
+
+        // Reset the elevations buffer position.
+        elevbuf = elev;
+        new_id = Rast_open_new(job->output, in_type);
+
+        dir_id = Rast_open_new(job->direction, CELL_TYPE);
+
+        // Rows and columns outside the data are written as null, or as no
+        // problem area.
+        if (job->areas != NULL) {
+            bas_id = Rast_open_new(job->areas, CELL_TYPE);
+            bas_buf = Rast_allocate_c_buf();
+        }
+        G_important_message(_("Writing filled, directions and problem maps..."));
+        wide_buf = Rast_allocate_d_buf();
+        for (i = 0; i < wrows; i++) {
+            G_percent(i, wrows, 5);
+
+            Rast_set_null_value(in_buf, wcols, work_type);
+            Rast_set_c_null_value(out_buf, wcols);
+            if (i >= row0 && i <= row1) {
+                memcpy((char *) in_buf + col0 * bpe(), elevbuf, bnd.sz);
+                elevbuf += bnd.sz;
+                rows_get(&drows, i - row0, out_buf + col0);
+            }
+            if (work_type != in_type) {
+                Rast_set_d_null_value(wide_buf, wcols);
+                widen_row(wide_buf + col0, (char *) in_buf + col0 * bpe(), ncols, work_type, res);
+                Rast_put_d_row(new_id, wide_buf);
+            } else
+                put_row(new_id, in_buf);
+
+            Rast_put_row(dir_id, out_buf, CELL_TYPE);
+
+            if (job->areas != NULL) {
+                for (j = 0; j < wcols; j += 1)
+                    bas_buf[j] = -1;
+                if (i >= row0 && i <= row1)
+                    spans_get_row(prob, i - row0, bas_buf + col0);
+                Rast_put_row(bas_id, bas_buf, CELL_TYPE);
+            }
+
+            if (set->timing) {
+                if (work_type != in_type)
+                    sum_elev = checksum(sum_elev, wide_buf, wcols * sizeof(DCELL));
+                else
+                    sum_elev = checksum(sum_elev, in_buf, (size_t) wcols * bpe());
+                sum_dir = checksum(sum_dir, out_buf, wcols * sizeof(CELL));
+                if (job->areas != NULL)
+                    sum_bas = checksum(sum_bas, bas_buf, wcols * sizeof(CELL));
+            }
+        }
+        G_percent(1, 1, 1);
+        G_free(wide_buf);
+
+        // Copy color table from input.
+        if (job->rawin == NULL)
+            Rast_write_colors(job->output, G_mapset(), &colors);
+
+        // Close up the rasters; the map buffers are kept for the next map.
+        Rast_close(new_id);    
+        Rast_close(dir_id);
+        if (job->areas != NULL) {
+            Rast_close(bas_id);
+            G_free(bas_buf);
+        }
+    }
+
+    // Hand the buffers over as they are.
+    if (job->raw != NULL) {
+        G_important_message(_("Writing raw files..."));
+        if (work_type != in_type)
+            write_bil_wide(job->raw, "elev", elev, nrows, ncols, work_type, res,
+                           &window, row0, col0);
+        else
+            write_bil(job->raw, "elev", elev, nrows, ncols, bpe(), in_type != CELL_TYPE,
+                      &window, row0, col0);
+        write_bil_rows(job->raw, "dir", &drows, nrows, ncols, &window, row0, col0);
+    }
+
+    spans_free(prob);
+    if (drows.z != NULL) {
+        G_verbose_message(_("Directions took %ldMB compressed"),
+                          (long) (zrows_bytes(drows.z) / mb));
+        zrows_free(drows.z);
+    }
+    if (job->rawin != NULL)
+        munmap(elev, mapsize * bpe());
 
     G_free(in_buf);
     G_free(out_buf);
 
+    stage_done(set, &t, _("Writing"));
+    if (set->timing && !set->raw_only) {
+        G_message(_("Checksum of <%s>: %016llx"), job->output, (unsigned long long) sum_elev);
+        G_message(_("Checksum of <%s>: %016llx"), job->direction, (unsigned long long) sum_dir);
+        if (job->areas != NULL)
+            G_message(_("Checksum of <%s>: %016llx"), job->areas, (unsigned long long) sum_bas);
+    }
+
+    return 0;
+}
+
+/* fill one map and report how long it took */
+static int run_job(struct job *job, struct settings *set, struct buffers *buf)
+{
+    double t;
+    int rc;
+
+    t = now();
+    rc = fill_map(job, set, buf);
+    G_message(_("Filled <%s> in %.2f seconds"), job->input ? job->input : job->rawin,
+              now() - t);
+    return rc;
+}
+
+/* read the maps of a batch file, one input,output,direction[,areas[,stats]]
+ * per line; blank lines and lines starting with # are skipped */
+static struct job *read_jobs(const char *name, int *njobs)
+{
+    FILE *fp;
+    char line[4096], *p;
+    char **tokens;
+    struct job *jobs = NULL;
+    int n, k, lineno;
+
+    if (!(fp = fopen(name, "r")))
+        G_fatal_error(_("Unable to open <%s>: %s"), name, strerror(errno));
+
+    *njobs = lineno = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineno += 1;
+        if ((p = strpbrk(line, "\r\n")))
+            *p = 0;
+        for (p = line; *p == ' ' || *p == '\t'; p++)
+            ;
+        if (*p == 0 || *p == '#')
+            continue;
+        tokens = G_tokenize(p, ",");
+        n = G_number_of_tokens(tokens);
+        for (k = 0; k < n; k += 1)
+            G_strip(tokens[k]);
+        if (n < 3 || n > 5)
+            G_fatal_error(_("Line %d of <%s> must be input,output,direction[,areas[,stats]]"),
+                          lineno, name);
+        jobs = G_realloc(jobs, (*njobs + 1) * sizeof(struct job));
+        jobs[*njobs].input = G_store(tokens[0]);
+        jobs[*njobs].output = G_store(tokens[1]);
+        jobs[*njobs].direction = G_store(tokens[2]);
+        jobs[*njobs].areas = n > 3 && *tokens[3] ? G_store(tokens[3]) : NULL;
+        jobs[*njobs].stats = n > 4 && *tokens[4] ? G_store(tokens[4]) : NULL;
+        jobs[*njobs].raw = NULL;
+        jobs[*njobs].rawin = NULL;
+        jobs[*njobs].hierarchy = NULL;
+        *njobs += 1;
+        G_free_tokens(tokens);
+    }
+    fclose(fp);
+    return jobs;
+}
+
+/* Start a worker process that fills maps of a batch until none are left,
+ * taking the number of the next one from a counter the workers share. */
+static pid_t start_worker(struct job *jobs, int njobs, struct settings *set, int *next)
+{
+    struct buffers buf = { 0 };
+    int failed, k;
+    pid_t pid;
+
+    if ((pid = fork()) < 0)
+        G_fatal_error(_("Unable to start worker: %s"), strerror(errno));
+    if (pid == 0) {
+        // The workers share the cores, one thread each.
+        set->nprocs = 1;
+#if defined(_OPENMP)
+        omp_set_num_threads(1);
+#endif
+        failed = 0;
+        while ((k = __sync_fetch_and_add(next, 1)) < njobs)
+            failed += run_job(&jobs[k], set, &buf) != 0;
+        _exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    return pid;
+}
+
+/* Fill the maps of a batch with up to nprocs worker processes. The GRASS
+ * libraries are not thread safe, so each worker is a process of its own
+ * that takes the next map and keeps its buffers for the maps after it.
+ * Even a single worker is a process of its own, so that a fatal error on
+ * one map only ends its worker, and another is started for the maps left.
+ * Returns the number of maps or workers that failed. */
+static int run_batch(struct job *jobs, int njobs, struct settings *set)
+{
+    struct buffers buf = { 0 };
+    int nworkers, failed, status, k;
+    int *next;
+
+    nworkers = set->nprocs < njobs ? set->nprocs : njobs;
+    failed = 0;
+
+    if (njobs <= 1) {
+        for (k = 0; k < njobs; k += 1)
+            failed += run_job(&jobs[k], set, &buf) != 0;
+    } else {
+        next = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (next == MAP_FAILED)
+            G_fatal_error(_("Unable to share the batch between workers: %s"), strerror(errno));
+        *next = 0;
+        for (k = 0; k < nworkers; k += 1)
+            start_worker(jobs, njobs, set, next);
+        while (wait(&status) > 0) {
+            if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+                continue;
+            failed += 1;
+            // The map the worker was on is lost, the ones after it are not.
+            if (*(volatile int *) next < njobs)
+                start_worker(jobs, njobs, set, next);
+        }
+        munmap(next, sizeof(int));
+    }
+
+    if (buf.elev != NULL)
+        deallocate(buf.elev, buf.elevsize, buf.elevmode);
+    if (buf.dirs != NULL)
+        deallocate(buf.dirs, buf.dirsize, buf.dirsmode);
+
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+
+    int type, nprocs, njobs;
+    CELL dir_table[256];
+    struct GModule *module;
+    struct Option *opt1, *opt2, *opt3, *opt4, *opt5, *opt6, *opt7, *opt8, *opt9, *opt10;
+    struct Option *opt11, *opt12, *opt13, *opt14, *opt15, *opt16;
+    struct Option *opt17, *opt18, *opt19, *opt20, *opt21, *opt22, *opt23;
+    struct Flag *flag1, *flag2, *flag3, *flag4, *flag5, *flag6, *flag7;
+    struct settings set;
+    struct job one, *jobs;
+
+    // Initialize the GRASS environment variables.
+    G_gisinit(argv[0]);
+
+    module = G_define_module();
+    G_add_keyword(_("raster"));
+    G_add_keyword(_("hydrology"));
+    G_add_keyword(_("sink"));
+    G_add_keyword(_("fill sinks"));
+    G_add_keyword(_("depressions"));
+    module->description = _("Filters and generates a depressionless elevation map and a "
+        "flow direction map from a given elevation raster map.");
+    
+    opt1 = G_define_standard_option(G_OPT_R_ELEV);
+    opt1->key = "input";
+    opt1->required = NO;
+    
+    opt2 = G_define_standard_option(G_OPT_R_OUTPUT);
+    opt2->required = NO;
+    opt2->description = _("Name for output depressionless elevation raster map");
+    
+    opt4 = G_define_standard_option(G_OPT_R_OUTPUT);
+    opt4->key = "direction";
+    opt4->required = NO;
+    opt4->description = _("Name for output flow direction map for depressionless elevation raster map");
+
+    opt5 = G_define_standard_option(G_OPT_R_OUTPUT);
+    opt5->key = "areas";
+    opt5->required = NO;
+    opt5->description = _("Name for output raster map of problem areas");
+
+    opt6 = G_define_standard_option(G_OPT_F_OUTPUT);
+    opt6->key = "stats";
+    opt6->required = NO;
+    opt6->description = _("Name for output CSV file of per-basin spill statistics");
+
+    opt3 = G_define_option();
+    opt3->key = "format";
+    opt3->type = TYPE_STRING;
+    opt3->required = NO;
+    opt3->description = _("Aspect direction format");
+    opt3->options = "agnps,answers,grass";
+    opt3->answer = "grass";
+
+    opt7 = G_define_option();
+    opt7->key = "nprocs";
+    opt7->type = TYPE_INTEGER;
+    opt7->required = NO;
+    opt7->description = _("Number of threads for parallel computing, or of worker processes with <file>");
+    opt7->answer = "1";
+
+    opt8 = G_define_standard_option(G_OPT_MEMORYMB);
+    opt8->answer = NULL;
+    opt8->description = _("Maximum memory to be used (in MB); "
+        "larger buffers are paged through temporary files");
+
+    opt9 = G_define_standard_option(G_OPT_F_INPUT);
+    opt9->key = "file";
+    opt9->required = NO;
+    opt9->description = _("Name of file listing maps to fill, one "
+        "input,output,direction[,areas[,stats]] per line");
+
+    opt10 = G_define_standard_option(G_OPT_F_OUTPUT);
+    opt10->key = "raw";
+    opt10->required = NO;
+    opt10->description = _("Base name for raw BIL files of the filled elevations "
+        "and directions, each with an ESRI .hdr file");
+
+    opt11 = G_define_standard_option(G_OPT_F_INPUT);
+    opt11->key = "rawin";
+    opt11->required = NO;
+    opt11->description = _("Name of raw little-endian grid to read instead of <input>, "
+        "of the size of the current region");
+
+    opt12 = G_define_option();
+    opt12->key = "rawtype";
+    opt12->type = TYPE_STRING;
+    opt12->required = NO;
+    opt12->description = _("Cell type of <rawin>");
+    opt12->options = "CELL,FCELL,DCELL";
+    opt12->answer = "FCELL";
+
+    opt13 = G_define_option();
+    opt13->key = "nodata";
+    opt13->type = TYPE_DOUBLE;
+    opt13->required = NO;
+    opt13->description = _("Value of null cells in <rawin>");
+
+    opt14 = G_define_option();
+    opt14->key = "precision";
+    opt14->type = TYPE_STRING;
+    opt14->required = NO;
+    opt14->description = _("Precision DCELL elevations are processed at");
+    opt14->options = "double,float,int";
+    opt14->answer = "double";
+
+    opt15 = G_define_option();
+    opt15->key = "resolution";
+    opt15->type = TYPE_DOUBLE;
+    opt15->required = NO;
+    opt15->description = _("Smallest elevation step carried by the data, "
+        "required with precision=int");
+
+    opt16 = G_define_option();
+    opt16->key = "coarse";
+    opt16->type = TYPE_INTEGER;
+    opt16->required = NO;
+    opt16->description = _("Size of the blocks of a coarse grid to pre-solve "
+        "large depressions on");
+
+    opt17 = G_define_standard_option(G_OPT_F_OUTPUT);
+    opt17->key = "hierarchy";
+    opt17->required = NO;
+    opt17->description = _("Name of depression hierarchy file, written when "
+        "filling and read by <query>");
+
+    opt18 = G_define_option();
+    opt18->key = "query";
+    opt18->type = TYPE_STRING;
+    opt18->required = NO;
+    opt18->description = _("Answer from <hierarchy> instead of filling: fill "
+        "to level <value>, fill basins of fewer than <value> cells, or print volumes");
+    opt18->options = "level,size,volume";
+
+    opt19 = G_define_option();
+    opt19->key = "value";
+    opt19->type = TYPE_DOUBLE;
+    opt19->required = NO;
+    opt19->description = _("Level or number of cells for <query>");
+
+    opt20 = G_define_option();
+    opt20->key = "numa";
+    opt20->type = TYPE_STRING;
+    opt20->required = NO;
+    opt20->description = _("Placement of the buffers on machines with several memory nodes");
+    opt20->options = "none,interleave,bands";
+    opt20->answer = "none";
+
+    opt21 = G_define_option();
+    opt21->key = "stage";
+    opt21->type = TYPE_STRING;
+    opt21->required = NO;
+    opt21->description = _("Step of a fill split into tiles: flood the tile in the "
+        "current region, merge the graphs of all tiles, or apply the merged levels to a tile");
+    opt21->options = "tile,merge,apply";
+
+    opt22 = G_define_option();
+    opt22->key = "tile";
+    opt22->type = TYPE_STRING;
+    opt22->required = NO;
+    opt22->multiple = YES;
+    opt22->key_desc = "name";
+    opt22->description = _("Base name of the files of a tile, or of every tile for stage=merge");
+
+    opt23 = G_define_option();
+    opt23->key = "socket";
+    opt23->type = TYPE_STRING;
+    opt23->required = NO;
+    opt23->key_desc = "name";
+    opt23->description = _("Unix domain socket on which to serve fills of windows of the input map");
+    
+    flag1 = G_define_flag();
+    flag1->key = 'f';
+    flag1->description = _("Find unresolved areas only");
+    
+    flag2 = G_define_flag();
+    flag2->key = 'm';
+    flag2->description = _("Use mapped memory");
+
+    flag3 = G_define_flag();
+    flag3->key = 'e';
+    flag3->description = _("Fill with a minimal gradient toward the outlets so that no flat areas remain");
+
+    flag4 = G_define_flag();
+    flag4->key = 'p';
+    flag4->description = _("Fill all depressions at once with a parallel priority-flood");
+
+    flag5 = G_define_flag();
+    flag5->key = 't';
+    flag5->description = _("Report the time taken by each stage and checksums of the outputs");
+
+    flag6 = G_define_flag();
+    flag6->key = 'r';
+    flag6->description = _("Write only the raw files, not the raster maps");
+
+    flag7 = G_define_flag();
+    flag7->key = 'z';
+    flag7->description = _("Keep the flow directions compressed in memory");
+    
+    if (G_parser(argc, argv))
+	   exit(EXIT_FAILURE);
+
+    // The steps of a tiled fill each do one thing and exit.
+    if (opt21->answer != NULL) {
+        if (opt22->answers == NULL)
+            G_fatal_error(_("<%s> requires <%s>"), opt21->key, opt22->key);
+        if (strcmp(opt21->answer, "merge") == 0) {
+            for (njobs = 0; opt22->answers[njobs] != NULL; njobs++)
+                ;
+            tile_merge(opt22->answers, njobs);
+            exit(EXIT_SUCCESS);
+        }
+        if (!opt1->answer || !opt2->answer || opt22->answers[1] != NULL)
+            G_fatal_error(_("stage=%s requires <%s>, <%s> and one <%s>"),
+                          opt21->answer, opt1->key, opt2->key, opt22->key);
+        if (strcmp(opt21->answer, "tile") == 0)
+            tile_flood(opt1->answer, opt2->answer, opt22->answer);
+        else
+            tile_apply(opt1->answer, opt2->answer, opt22->answer);
+        exit(EXIT_SUCCESS);
+    }
+
+    // A query only reads the hierarchy, and the input map unless it asks
+    // for volumes.
+    if (opt18->answer != NULL) {
+        if (opt17->answer == NULL)
+            G_fatal_error(_("<%s> requires <%s>"), opt18->key, opt17->key);
+        if (strcmp(opt18->answer, "volume") == 0) {
+            query_hier(opt17->answer, QUERY_VOLUME, 0., NULL, NULL);
+            exit(EXIT_SUCCESS);
+        }
+        if (!opt1->answer || !opt2->answer || !opt19->answer)
+            G_fatal_error(_("query=%s requires <%s>, <%s> and <%s>"),
+                          opt18->answer, opt1->key, opt2->key, opt19->key);
+        query_hier(opt17->answer, strcmp(opt18->answer, "level") == 0 ? QUERY_LEVEL : QUERY_SIZE,
+                   atof(opt19->answer), opt1->answer, opt2->answer);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (opt9->answer != NULL && (opt1->answer || opt2->answer || opt4->answer ||
+                                 opt5->answer || opt6->answer || opt10->answer ||
+                                 opt11->answer || opt17->answer))
+    	G_fatal_error(_("<%s> cannot be used with the options for a single map"), opt9->key);
+
+    if (flag6->answer && opt10->answer == NULL)
+    	G_fatal_error(_("The '%c' flag requires '%s'to be specified"), flag6->key, opt10->key);
+
+    if (flag6->answer && opt5->answer != NULL)
+    	G_fatal_error(_("The '%c' flag cannot be used with '%s'"), flag6->key, opt5->key);
+
+    if (opt1->answer && opt11->answer)
+    	G_fatal_error(_("<%s> and <%s> are mutually exclusive"), opt1->key, opt11->key);
+
+    if (opt23->answer != NULL && (opt1->answer == NULL || opt9->answer || opt11->answer ||
+                                  flag1->answer || flag6->answer))
+    	G_fatal_error(_("<%s> requires <%s> and cannot be used with <%s>, <%s> or the '%c' and '%c' flags"),
+                      opt23->key, opt1->key, opt9->key, opt11->key, flag1->key, flag6->key);
+
+    // The service sends its fills back over the socket and holds them in
+    // memory, so it has no maps to write and no buffers to place.
+    if (opt23->answer != NULL && (opt2->answer || opt4->answer || opt5->answer ||
+                                  opt6->answer || opt10->answer || opt17->answer))
+    	G_fatal_error(_("<%s> cannot be used with <%s>, <%s>, <%s>, <%s>, <%s> or <%s>"),
+                      opt23->key, opt2->key, opt4->key, opt5->key, opt6->key, opt10->key,
+                      opt17->key);
+
+    if (opt23->answer != NULL && (opt8->answer || strcmp(opt14->answer, "double") != 0 ||
+                                  strcmp(opt20->answer, "none") != 0 ||
+                                  flag2->answer || flag5->answer || flag7->answer))
+    	G_fatal_error(_("<%s> cannot be used with <%s>, <%s>, <%s> or the '%c', '%c' and '%c' flags"),
+                      opt23->key, opt8->key, opt14->key, opt20->key, flag2->key, flag5->key,
+                      flag7->key);
+
+    if (opt9->answer == NULL && opt23->answer == NULL &&
+        ((!opt1->answer && !opt11->answer) ||
+         (!flag6->answer && (!opt2->answer || !opt4->answer))))
+    	G_fatal_error(_("Either <%s> or <%s>, <%s> and <%s> must be given"),
+                      opt9->key, opt1->key, opt2->key, opt4->key);
+
+    if (flag1->answer && flag3->answer)
+    	G_fatal_error(_("The '%c' and '%c' flags are mutually exclusive"), flag1->key, flag3->key);
+
+    if (flag4->answer && flag1->answer)
+    	G_fatal_error(_("The '%c' and '%c' flags are mutually exclusive"), flag1->key, flag4->key);
+
+    if (flag4->answer && flag3->answer)
+    	G_fatal_error(_("The '%c' and '%c' flags are mutually exclusive"), flag3->key, flag4->key);
+
+    if (opt17->answer && (flag1->answer || flag3->answer || flag4->answer))
+    	G_fatal_error(_("<%s> cannot be used with the '%c', '%c' or '%c' flags"),
+                      opt17->key, flag1->key, flag3->key, flag4->key);
+
+    if (flag1->answer && opt16->answer)
+    	G_fatal_error(_("The '%c' flag cannot be used with '%s'"), flag1->key, opt16->key);
+
+    nprocs = atoi(opt7->answer);
+    if (nprocs < 1)
+    	G_fatal_error(_("<%s> must be > 0"), opt7->key);
+#if defined(_OPENMP)
+    omp_set_num_threads(nprocs);
+#else
+    if (nprocs > 1)
+    	G_warning(_("OpenMP support not enabled, using a single thread"));
+    nprocs = 1;
+#endif
+
+    type = 0;
+    if (strcmp(opt3->answer, "agnps") == 0)
+	   type = 1;
+    else if (strcmp(opt3->answer, "answers") == 0)
+	   type = 2;
+    else if (strcmp(opt3->answer, "grass") == 0)
+	   type = 3;
+    
+    G_debug(1, "output type (1=AGNPS, 2=ANSWERS, 3=GRASS): %d", type);
+
+    if (type == 3)
+	   G_verbose_message(_("Direction map is D8 resolution, i.e. 45 degrees"));
+
+    set.type = type;
+    set.find_only = flag1->answer;
+    set.mapped = flag2->answer;
+    set.gradient = flag3->answer;
+    set.parallel = flag4->answer;
+    set.own_region = opt9->answer != NULL;
+    set.timing = flag5->answer;
+    set.raw_only = flag6->answer;
+    set.compress = flag7->answer;
+    set.nprocs = nprocs;
+    set.numa = NUMA_NONE;
+    if (strcmp(opt20->answer, "interleave") == 0)
+        set.numa = NUMA_INTERLEAVE;
+    else if (strcmp(opt20->answer, "bands") == 0)
+        set.numa = NUMA_BANDS;
+    set.budget = 0;
+    set.rawtype = CELL_TYPE;
+    if (strcmp(opt12->answer, "FCELL") == 0)
+        set.rawtype = FCELL_TYPE;
+    else if (strcmp(opt12->answer, "DCELL") == 0)
+        set.rawtype = DCELL_TYPE;
+    set.coarse = 0;
+    if (opt16->answer != NULL) {
+        set.coarse = atoi(opt16->answer);
+        if (set.coarse < 2)
+            G_fatal_error(_("<%s> must be > 1"), opt16->key);
+    }
+    set.precision = DCELL_TYPE;
+    if (strcmp(opt14->answer, "float") == 0)
+        set.precision = FCELL_TYPE;
+    else if (strcmp(opt14->answer, "int") == 0)
+        set.precision = CELL_TYPE;
+    set.resolution = opt15->answer != NULL ? atof(opt15->answer) : 0.;
+    if (set.precision == CELL_TYPE && set.resolution <= 0.)
+        G_fatal_error(_("precision=int requires <%s> > 0"), opt15->key);
+    set.has_nodata = opt13->answer != NULL;
+    set.nodata = set.has_nodata ? atof(opt13->answer) : 0.;
+    if (opt8->answer != NULL) {
+        set.budget = (off_t) atoi(opt8->answer) * 1024 * 1024;
+        if (set.budget <= 0)
+            G_fatal_error(_("<%s> must be > 0"), opt8->key);
+    }
+
+    // The service keeps the map and answers until it is stopped.
+    if (opt23->answer != NULL) {
+        int j;
+
+        for (j = 0; j < 256; j++)
+            dir_table[j] = dir_type(type, j);
+        serve(opt1->answer, opt23->answer, dir_table, set.gradient, set.parallel,
+              set.coarse, nprocs);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (opt9->answer == NULL) {
+        one.input = opt1->answer;
+        one.output = opt2->answer;
+        one.direction = opt4->answer;
+        one.areas = opt5->answer;
+        one.stats = opt6->answer;
+        one.raw = opt10->answer;
+        one.rawin = opt11->answer;
+        one.hierarchy = opt17->answer;
+        jobs = &one;
+        njobs = 1;
+    } else {
+        jobs = read_jobs(opt9->answer, &njobs);
+        G_message(n_("Filling %d map with %d worker", "Filling %d maps with %d workers", njobs),
+                  njobs, nprocs < njobs ? nprocs : njobs);
+    }
+
+    if (run_batch(jobs, njobs, &set) != 0)
+        G_fatal_error(_("Some maps could not be filled"));
+
     exit(EXIT_SUCCESS);
 }
 
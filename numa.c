@@ -0,0 +1,128 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+#include <grass/gis.h>
+#include <grass/glocale.h>
+#include "tinf.h"
+#include "ds.h"
+#include "local.h"
+
+/* Placement of the map buffers on machines with several memory nodes.
+ * Pages go to the node of the thread that first writes them, so unless
+ * something is done the single-threaded read loop puts every buffer on
+ * one node.  Either the pages are interleaved over all nodes, or each
+ * band of rows is first written by the thread that processes it in the
+ * parallel stages, which all split the rows into static bands.  The
+ * threads are pinned to cores so that they stay by their bands.  The
+ * kernel interface is called directly, so libnuma is not needed. */
+
+#define MPOL_INTERLEAVE_ 3
+#define MPOL_MF_MOVE_ (1 << 1)
+
+/* the online nodes as a bit mask, 0 if unknown */
+static unsigned long online_nodes(void)
+{
+    FILE *fp;
+    unsigned long mask;
+    int a, b, c;
+
+    if (!(fp = fopen("/sys/devices/system/node/online", "r")))
+	return 0;
+    mask = 0;
+    while (fscanf(fp, "%d", &a) == 1) {
+	b = a;
+	c = fgetc(fp);
+	if (c == '-') {
+	    if (fscanf(fp, "%d", &b) != 1)
+		break;
+	    c = fgetc(fp);
+	}
+	for (; a <= b && a < (int)(8 * sizeof(mask)); a += 1)
+	    mask |= 1UL << a;
+	if (c != ',')
+	    break;
+    }
+    fclose(fp);
+    return mask;
+}
+
+/* spread the pages of a buffer over all nodes, moving any already there */
+static void interleave(char *buf, off_t size)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long mask;
+    long page;
+    char *start;
+
+    mask = online_nodes();
+    if ((mask & (mask - 1)) == 0)
+	return;
+
+    page = sysconf(_SC_PAGE_SIZE);
+    start = (char *)(((unsigned long)buf + page - 1) & ~(page - 1));
+    if (start >= buf + size)
+	return;
+    if (syscall(SYS_mbind, start, (unsigned long)(buf + size - start),
+		MPOL_INTERLEAVE_, &mask, 8 * sizeof(mask) + 1,
+		MPOL_MF_MOVE_) != 0)
+	G_warning(_("Unable to interleave memory: %s"), strerror(errno));
+#endif
+}
+
+/* write every row once from the thread whose static band it falls in */
+static void first_touch(char *buf, int nrows, off_t rowsz)
+{
+    int i;
+
+#pragma omp parallel for schedule(static)
+    for (i = 0; i < nrows; i += 1)
+	memset(buf + (off_t) i * rowsz, 0, rowsz);
+}
+
+void numa_place(char *buf, int nrows, off_t rowsz, int policy)
+{
+    if (policy == NUMA_INTERLEAVE)
+	interleave(buf, (off_t) nrows * rowsz);
+    else if (policy == NUMA_BANDS)
+	first_touch(buf, nrows, rowsz);
+}
+
+/* pin each thread of the team to one of the allowed cores, in order, so
+ * that consecutive threads, and their bands, share a node */
+void numa_pin(void)
+{
+#if defined(__linux__) && defined(_OPENMP)
+    cpu_set_t allowed;
+
+    if (omp_get_max_threads() < 2 ||
+	sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+	return;
+
+#pragma omp parallel
+    {
+	cpu_set_t one;
+	int k, cpu, n;
+
+	n = omp_get_thread_num() % CPU_COUNT(&allowed);
+	for (cpu = 0, k = -1; cpu < CPU_SETSIZE; cpu += 1) {
+	    if (CPU_ISSET(cpu, &allowed) && ++k == n)
+		break;
+	}
+	CPU_ZERO(&one);
+	CPU_SET(cpu, &one);
+	sched_setaffinity(0, sizeof(one), &one);
+    }
+#endif
+}
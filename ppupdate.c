@@ -1,10 +1,14 @@
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <math.h>
 #include <grass/gis.h>
 #include <grass/raster.h>
 //#include <omp.h>
 
 #include "tinf.h"
+#include "ds.h"
+#include "local.h"
 
 struct links
 {
@@ -29,14 +33,15 @@ void backtrace(int start, int nbasins, struct links list[])
     }
 }
 
-void ppupdate(char* elevs, char* prob, int nl, int nbasins, struct band3 *elev,
-	      struct band3 *basins)
+void ppupdate(char* elevs, struct spans* prob, int nl, int nbasins, struct band3 *elev,
+	      struct band3 *basins, struct nullmask *mask,
+	      struct basin_stats *stats)
 {
     int i;
 
     //#pragma omp parallel
     {
-	    int j, ii, n;
+	    int j, ii, n, that_null;
 	    CELL *here;
 	    CELL that_basin;
 	    void *barrier_height;
@@ -44,31 +49,42 @@ void ppupdate(char* elevs, char* prob, int nl, int nbasins, struct band3 *elev,
 	    void *that_elev;
 
 	    struct links *list;
+	    struct arena scratch = { 0 };
 
 	    char* elevbuf;
-	    char* probbuf;
 
 	    list = G_malloc((nbasins + 1) * sizeof(struct links));
 
 	    for (i = 1; i <= nbasins; i += 1) {
 			list[i].next = -1;
-			list[i].pp = G_malloc(bpe());
+			list[i].pp = arena_alloc(&scratch, bpe());
 			set_max(list[i].pp);
 
 			list[i].next_alt = -1;
-			list[i].pp_alt = G_malloc(bpe());
+			list[i].pp_alt = arena_alloc(&scratch, bpe());
 			set_max(list[i].pp_alt);
 
 			list[i].trace = 0;
 	    }
 
+	    if (stats) {
+			for (i = 1; i <= nbasins; i += 1) {
+			    stats[i].cells = 0;
+			    stats[i].volume = 0.;
+			    stats[i].bottom = HUGE_VAL;
+			    stats[i].n = stats[i].w = INT_MAX;
+			    stats[i].s = stats[i].e = -1;
+			}
+	    }
+
 	    elevbuf = elevs;
-	    probbuf = prob;
 
 	    //#pragma omp critical(__prob)
 	    {
-		    advance_band3mem(&probbuf, basins);
-		    advance_band3mem(&probbuf, basins);
+		    advance_band3mem(0, basins);
+		    spans_get_row(prob, 0, (CELL *) basins->b[2]);
+		    advance_band3mem(0, basins);
+		    spans_get_row(prob, 1, (CELL *) basins->b[2]);
 		}
 
 		//#pragma omp critical(__elev) 
@@ -78,17 +94,19 @@ void ppupdate(char* elevs, char* prob, int nl, int nbasins, struct band3 *elev,
 		}
 
 	    //#pragma omp for
-	    for (i = 1; i < nl - 3; i += 1) {
+	    for (i = 1; i < nl - 1; i += 1) {
 	    	//#pragma omp critical(__prob)
-			advance_band3mem(&probbuf, basins);
+			advance_band3mem(0, basins);
+			spans_get_row(prob, i + 1, (CELL *) basins->b[2]);
 			//#pragma omp critical(__elev)
 			advance_band3mem(&elevbuf, elev);
 
-			for (j = 1; j < basins->ns - 1; j += 1) {
+			for (j = nullmask_next(mask, i, 1, basins->ns - 1); j < basins->ns - 1;
+			     j = nullmask_next(mask, i, j + 1, basins->ns - 1)) {
 
-			    /* check to see if the cell is non-null and in a basin */
+			    /* check to see if the cell is in a basin */
 			    here = (CELL *) basins->b[1] + j;
-			    if (Rast_is_c_null_value(here) || *here < 0)
+			    if (*here < 0)
 					continue;
 
 			    ii = *here;
@@ -101,41 +119,49 @@ void ppupdate(char* elevs, char* prob, int nl, int nbasins, struct band3 *elev,
 					case 0:
 					    that_basin = *((CELL *) basins->b[0] + j + 1);
 					    that_elev = elev->b[0] + (j + 1) * bpe();
+					    that_null = nullmask_get(mask, i - 1, j + 1);
 					    break;
 					case 1:
 					    that_basin = *((CELL *) basins->b[1] + j + 1);
 					    that_elev = elev->b[1] + (j + 1) * bpe();
+					    that_null = nullmask_get(mask, i, j + 1);
 					    break;
 					case 2:
 					    that_basin = *((CELL *) basins->b[2] + j + 1);
 					    that_elev = elev->b[2] + (j + 1) * bpe();
+					    that_null = nullmask_get(mask, i + 1, j + 1);
 					    break;
 					case 3:
 					    that_basin = *((CELL *) basins->b[2] + j);
 					    that_elev = elev->b[2] + j * bpe();
+					    that_null = nullmask_get(mask, i + 1, j);
 					    break;
 					case 4:
 					    that_basin = *((CELL *) basins->b[2] + j - 1);
 					    that_elev = elev->b[2] + (j - 1) * bpe();
+					    that_null = nullmask_get(mask, i + 1, j - 1);
 					    break;
 					case 5:
 					    that_basin = *((CELL *) basins->b[1] + j - 1);
 					    that_elev = elev->b[1] + (j - 1) * bpe();
+					    that_null = nullmask_get(mask, i, j - 1);
 					    break;
 					case 6:
 					    that_basin = *((CELL *) basins->b[0] + j - 1);
 					    that_elev = elev->b[0] + (j - 1) * bpe();
+					    that_null = nullmask_get(mask, i - 1, j - 1);
 					    break;
 					case 7:
 					    that_basin = *((CELL *) basins->b[0] + j);
 					    that_elev = elev->b[0] + j * bpe();
+					    that_null = nullmask_get(mask, i - 1, j);
 
 					}		/* end switch */
 
 					/* see if we're on a boundary */
 					if (that_basin != ii) {
 					    /* what is that_basin if that_elev is null ? */
-					    if (is_null(that_elev)) {
+					    if (that_null) {
 							barrier_height = this_elev;
 					    } else {
 							barrier_height = get_max(that_elev, this_elev);
@@ -202,6 +228,15 @@ void ppupdate(char* elevs, char* prob, int nl, int nbasins, struct band3 *elev,
 
 	    }				/* end loop */
 
+	    /* each basin's own pour point, before it is raised to the level of
+	     * the basins it overflows into */
+	    if (stats) {
+			for (i = 1; i <= nbasins; i += 1) {
+			    stats[i].next = list[i].next;
+			    stats[i].pour = get_dbl(list[i].pp);
+			}
+	    }
+
 	    /* backtrace drainages from the bottom and adjust pour points */
 	    for (i = 1; i <= nbasins; i += 1) {
 			if (list[i].next == -1) {
@@ -212,29 +247,50 @@ void ppupdate(char* elevs, char* prob, int nl, int nbasins, struct band3 *elev,
 
 	    /* fill all basins up to the elevation of their lowest bounding elevation */
 	    elevbuf = elevs;
-	    probbuf = prob;
 
 	    for (i = 0; i < nl; i += 1) {
 	    	//#pragma omp critical(__elev)
 	    	memcpy(elev->b[1], elevbuf, elev->sz);
 	    	elevbuf += elev->sz;
 	    	//#pragma omp critical(__prob)
-	    	memcpy(basins->b[1], probbuf, basins->sz);
-	    	probbuf += basins->sz;
+	    	spans_get_row(prob, i, (CELL *) basins->b[1]);
 
-			for (j = 0; j < basins->ns; j += 1) {
+			/* null cells drain the map and are never filled */
+			for (j = nullmask_next(mask, i, 0, basins->ns); j < basins->ns;
+			     j = nullmask_next(mask, i, j + 1, basins->ns)) {
 			    ii = *((CELL *) basins->b[1] + j);
 			    if (ii <= 0)
 					continue;
 			    this_elev = elev->b[1] + j * bpe();
+			    if (stats) {
+					stats[ii].cells += 1;
+					if (get_max(this_elev, list[ii].pp) != this_elev)
+					    stats[ii].volume += get_dbl(list[ii].pp) - get_dbl(this_elev);
+					if (get_dbl(this_elev) < stats[ii].bottom)
+					    stats[ii].bottom = get_dbl(this_elev);
+					if (i < stats[ii].n)
+					    stats[ii].n = i;
+					stats[ii].s = i;
+					if (j < stats[ii].w)
+					    stats[ii].w = j;
+					if (j > stats[ii].e)
+					    stats[ii].e = j;
+			    }
 			    memcpy(this_elev, get_max(this_elev, list[ii].pp), bpe());
 			}
 			
 			elevbuf -= elev->sz;
 			//#pragma omp critical(__elev)
 			memcpy(elevbuf, elev->b[1], elev->sz);
+			elevbuf += elev->sz;
+	    }
+
+	    if (stats) {
+			for (i = 1; i <= nbasins; i += 1)
+			    stats[i].spill = get_dbl(list[i].pp);
 	    }
 
+	    arena_free(&scratch);
 	    G_free(list);
 	}
 }
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <grass/gis.h>
+#include <grass/raster.h>
+#include <grass/glocale.h>
+#include "tinf.h"
+#include "ds.h"
+#include "local.h"
+
+/* widen n cells of a reduced precision type, with integers counting
+ * steps of res, to DCELL */
+void widen_row(DCELL *out, const void *in, int n, int type, double res)
+{
+    int j;
+
+    for (j = 0; j < n; j += 1) {
+	if (type == FCELL_TYPE)
+	    out[j] = ((const FCELL *) in)[j];
+	else if (Rast_is_c_null_value((const CELL *) in + j))
+	    Rast_set_d_null_value(out + j, 1);
+	else
+	    out[j] = ((const CELL *) in)[j] * res;
+    }
+}
+
+static FILE *open_file(const char *base, const char *band, const char *ext,
+		       char *name)
+{
+    FILE *fp;
+
+    snprintf(name, GPATH_MAX, "%s_%s.%s", base, band, ext);
+    if (!(fp = fopen(name, "wb")))
+	G_fatal_error(_("Unable to open <%s> for writing: %s"), name,
+		      strerror(errno));
+    return fp;
+}
+
+static void write_hdr(const char *base, const char *band, int nrows,
+		      int ncols, int bytes, int is_fp,
+		      struct Cell_head *window, int row0, int col0)
+{
+    char name[GPATH_MAX];
+    FILE *fp;
+    union {
+	int i;
+	char c;
+    } order;
+
+    order.i = 1;
+    fp = open_file(base, band, "hdr", name);
+    fprintf(fp, "BYTEORDER      %s\n", order.c ? "I" : "M");
+    fprintf(fp, "LAYOUT         BIL\n");
+    fprintf(fp, "NROWS          %d\n", nrows);
+    fprintf(fp, "NCOLS          %d\n", ncols);
+    fprintf(fp, "NBANDS         1\n");
+    fprintf(fp, "NBITS          %d\n", 8 * bytes);
+    fprintf(fp, "BANDROWBYTES   %d\n", ncols * bytes);
+    fprintf(fp, "TOTALROWBYTES  %d\n", ncols * bytes);
+    fprintf(fp, "PIXELTYPE      %s\n", is_fp ? "FLOAT" : "SIGNEDINT");
+    fprintf(fp, "ULXMAP         %.15g\n",
+	    Rast_col_to_easting(col0 + 0.5, window));
+    fprintf(fp, "ULYMAP         %.15g\n",
+	    Rast_row_to_northing(row0 + 0.5, window));
+    fprintf(fp, "XDIM           %.15g\n", window->ew_res);
+    fprintf(fp, "YDIM           %.15g\n", window->ns_res);
+    if (is_fp)
+	fprintf(fp, "NODATA         nan\n");
+    else
+	fprintf(fp, "NODATA         %d\n", INT_MIN);
+    if (fclose(fp) != 0)
+	G_fatal_error(_("Error writing <%s>: %s"), name, strerror(errno));
+}
+
+/* write a buffer of nrows by ncols values, whose first cell is at row0 and
+ * col0 of the region, to <base>_<band>.bil with an ESRI .hdr sidecar that
+ * GDAL and most HPC readers understand.  The values are written as they
+ * sit in memory, in one sequential write */
+void write_bil(const char *base, const char *band, const void *buf,
+	       int nrows, int ncols, int bytes, int is_fp,
+	       struct Cell_head *window, int row0, int col0)
+{
+    char name[GPATH_MAX];
+    FILE *fp;
+    size_t n;
+
+    n = (size_t) nrows * ncols;
+    fp = open_file(base, band, "bil", name);
+    if (fwrite(buf, bytes, n, fp) != n || fclose(fp) != 0)
+	G_fatal_error(_("Error writing <%s>: %s"), name, strerror(errno));
+    write_hdr(base, band, nrows, ncols, bytes, is_fp, window, row0, col0);
+}
+
+/* as write_bil(), for CELL rows that may be held compressed */
+void write_bil_rows(const char *base, const char *band, struct rows *rows,
+		    int nrows, int ncols, struct Cell_head *window, int row0,
+		    int col0)
+{
+    char name[GPATH_MAX];
+    FILE *fp;
+    CELL *row;
+    int i;
+
+    row = G_malloc(ncols * sizeof(CELL));
+    fp = open_file(base, band, "bil", name);
+    for (i = 0; i < nrows; i += 1) {
+	rows_get(rows, i, row);
+	if (fwrite(row, sizeof(CELL), ncols, fp) != (size_t) ncols)
+	    G_fatal_error(_("Error writing <%s>: %s"), name, strerror(errno));
+    }
+    if (fclose(fp) != 0)
+	G_fatal_error(_("Error writing <%s>: %s"), name, strerror(errno));
+    G_free(row);
+    write_hdr(base, band, nrows, ncols, sizeof(CELL), 0, window, row0, col0);
+}
+
+/* as write_bil(), for a buffer of reduced precision that is widened to
+ * DCELL a row at a time */
+void write_bil_wide(const char *base, const char *band, const void *buf,
+		    int nrows, int ncols, int type, double res,
+		    struct Cell_head *window, int row0, int col0)
+{
+    char name[GPATH_MAX];
+    FILE *fp;
+    DCELL *row;
+    int i, bytes;
+
+    bytes = type == FCELL_TYPE ? sizeof(FCELL) : sizeof(CELL);
+    row = G_malloc(ncols * sizeof(DCELL));
+    fp = open_file(base, band, "bil", name);
+    for (i = 0; i < nrows; i += 1) {
+	widen_row(row, (const char *) buf + (size_t) i * ncols * bytes, ncols,
+		  type, res);
+	if (fwrite(row, sizeof(DCELL), ncols, fp) != (size_t) ncols)
+	    G_fatal_error(_("Error writing <%s>: %s"), name, strerror(errno));
+    }
+    if (fclose(fp) != 0)
+	G_fatal_error(_("Error writing <%s>: %s"), name, strerror(errno));
+    G_free(row);
+    write_hdr(base, band, nrows, ncols, sizeof(DCELL), 1, window, row0, col0);
+}
@@ -4,6 +4,7 @@
 #include <grass/raster.h>
 #include <grass/glocale.h>
 #include "tinf.h"
+#include "ds.h"
 
 CELL select_dir(CELL i)
 {
@@ -32,197 +33,510 @@ CELL select_dir(CELL i)
     return dir[i];
 }
 
-void flink(int i, int j, int nl, int ns, CELL * p1, CELL * p2, CELL * p3,
-	   int *active, int *goagain)
+/* A flat is a connected group of cells with negative codes, whose bits are
+ * the directions of equal, lowest slope.  Each flat cell takes one of those
+ * directions as soon as a neighbour that way has a direction that does not
+ * point back, so directions spread in from where the flat drains.  Cells
+ * of different flats are never neighbours, so each flat is resolved on its
+ * own, and the flats are spread over the threads, largest first.  The
+ * lists are made for a band of rows at a time, as many as fit in the
+ * memory given. */
+
+struct flat
+{
+    int row, col;
+    CELL dir;			/* the code, and then the direction taken */
+    CELL out;			/* links to cells that are not flat */
+};
+
+/* the cells of one flat, as a range of the sorted cell list */
+struct flatset
+{
+    size_t first, n;
+};
+
+/* steps and the direction that points back, for bits 1 to 128 */
+static const int drow[8] = { -1, 0, 1, 1, 1, 0, -1, -1 };
+static const int dcol[8] = { 1, 1, 1, 0, -1, -1, -1, 0 };
+static const CELL back[8] = { 16, 32, 64, 128, 1, 2, 4, 8 };
+
+/* the most the lists and grid take for each flat cell */
+#define FLAT_BYTES (sizeof(struct flat) + 2 * sizeof(size_t) + \
+		    sizeof(struct flatset) + 4 * sizeof(CELL) + 1)
+
+static int by_size(const void *a, const void *b)
+{
+    const struct flatset *x = a, *y = b;
+
+    return x->n < y->n ? 1 : x->n > y->n ? -1 : 0;
+}
+
+static size_t find(size_t * up, size_t x)
 {
-    CELL bitmask[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
-    CELL outflow, cwork, c[8];
-    int k;
-
-    cwork = p2[j];
-    if (Rast_is_c_null_value(p2 + j) || cwork >= 0 || cwork == -256)
-	return;
-    cwork = -cwork;
-
-    for (k = 7; k >= 0; k--) {
-	c[k] = 0;
-	if (cwork >= bitmask[k]) {
-	    c[k] = 1;
-	    cwork -= bitmask[k];
+    while (up[x] != x) {
+	up[x] = up[up[x]];
+	x = up[x];
+    }
+    return x;
+}
+
+/* join two cells' groups under the one found first */
+static void join(size_t * up, size_t a, size_t b)
+{
+    a = find(up, a);
+    b = find(up, b);
+    if (a < b)
+	up[b] = a;
+    else if (b < a)
+	up[a] = b;
+}
+
+/* list the flat cells of rows r0 to r1 - 1 in row order, with the links
+ * out of each that lead to cells whose direction is already known */
+static size_t list_flats(struct flat *f, struct rows *dirs, int r0, int r1,
+			 struct band3 *bnd, struct nullmask *mask)
+{
+    CELL *p, v;
+    size_t n;
+    int i, j, k;
+
+    n = 0;
+    advance_band3mem(0, bnd);
+    rows_get(dirs, r0 - 1, bnd->b[2]);
+    advance_band3mem(0, bnd);
+    rows_get(dirs, r0, bnd->b[2]);
+    for (i = r0; i < r1; i += 1) {
+	advance_band3mem(0, bnd);
+	rows_get(dirs, i + 1, bnd->b[2]);
+
+	p = (CELL *) bnd->b[1];
+	for (j = nullmask_next(mask, i, 1, bnd->ns - 1); j < bnd->ns - 1;
+	     j = nullmask_next(mask, i, j + 1, bnd->ns - 1)) {
+	    if (p[j] >= 0 || p[j] == -256)
+		continue;
+	    f[n].row = i;
+	    f[n].col = j;
+	    f[n].dir = p[j];
+	    f[n].out = 0;
+	    for (k = 0; k < 8; k += 1) {
+		v = ((CELL *) bnd->b[1 + drow[k]])[j + dcol[k]];
+		if ((-p[j] & (1 << k)) && v > 0 && v != back[k])
+		    f[n].out |= 1 << k;
+	    }
+	    n += 1;
 	}
     }
+    return n;
+}
 
-    outflow = 0;
-
-    /* There's no need to resolve directions at cells adjacent to null cells,
-     * as those directions will be resolved before we get here */
-    /* look one row back */
-    cwork = p1[j - 1];
-    if (cwork > 0 && cwork != 4 && c[6])
-	outflow += 64;
-    cwork = p1[j];
-    if (cwork > 0 && cwork != 8 && c[7])
-	outflow += 128;
-    cwork = p1[j + 1];
-    if (cwork > 0 && cwork != 16 && c[0])
-	outflow += 1;
-
-    /* look at this row */
-    cwork = p2[j - 1];
-    if (cwork > 0 && cwork != 2 && c[5])
-	outflow += 32;
-    cwork = p2[j + 1];
-    if (cwork > 0 && cwork != 32 && c[1])
-	outflow += 2;
-
-    /* look one row forward */
-    cwork = p3[j - 1];
-    if (cwork > 0 && cwork != 1 && c[4])
-	outflow += 16;
-    cwork = p3[j];
-    if (cwork > 0 && cwork != 128 && c[3])
-	outflow += 8;
-    cwork = p3[j + 1];
-    if (cwork > 0 && cwork != 64 && c[2])
-	outflow += 4;
-
-    if (outflow == 0) {
-	*active = 1;
+/* group the listed cells into flats; cell lists each flat's cells in
+ * order, and the flats are returned largest first */
+static struct flatset *group_flats(const struct flat *f, size_t n,
+				   size_t * cell, size_t * nsets)
+{
+    struct flatset *set;
+    size_t *up, a, b, pa, pb, t, u, x, m;
+    int above;
+
+    up = G_malloc(n * sizeof(size_t));
+    for (x = 0; x < n; x += 1)
+	up[x] = x;
+
+    /* join each cell to its neighbours before it on its row and the row
+     * above, which are listed in column order */
+    pa = pb = 0;
+    for (a = 0; a < n; a = b) {
+	for (b = a + 1; b < n && f[b].row == f[a].row; b += 1) ;
+	above = pb > pa && f[pa].row == f[a].row - 1;
+	t = pa;
+	for (x = a; x < b; x += 1) {
+	    if (x > a && f[x - 1].col == f[x].col - 1)
+		join(up, x - 1, x);
+	    if (!above)
+		continue;
+	    while (t < pb && f[t].col < f[x].col - 1)
+		t += 1;
+	    for (u = t; u < pb && f[u].col <= f[x].col + 1; u += 1)
+		join(up, u, x);
+	}
+	pa = a;
+	pb = b;
     }
-    else {
-	*goagain = 1;
-	p2[j] = select_dir(outflow);
+
+    /* point every cell at its root, then number the flats in the order
+     * of their roots, which come before the rest of their cells */
+    for (x = 0; x < n; x += 1)
+	up[x] = find(up, x);
+    m = 0;
+    for (x = 0; x < n; x += 1)
+	up[x] = up[x] == x ? m++ : up[up[x]];
+
+    set = G_calloc(m, sizeof(struct flatset));
+    for (x = 0; x < n; x += 1)
+	set[up[x]].n += 1;
+    for (a = 0, x = 0; x < m; x += 1) {
+	set[x].first = a;
+	a += set[x].n;
+	set[x].n = 0;
     }
-    return;
+    for (x = 0; x < n; x += 1) {
+	cell[set[up[x]].first + set[up[x]].n] = x;
+	set[up[x]].n += 1;
+    }
+    G_free(up);
+
+    qsort(set, m, sizeof(struct flatset), by_size);
+    *nsets = m;
+    return set;
 }
 
-//void resolve(int fd, int nl, struct band3 *bnd)
-void resolve(char* dirs, int nl, struct band3 *bnd)
+/* a flat copied to a grid of its bounding box with a border, where cells
+ * outside the flat are 0; their links are kept in the cells' out.  A flat
+ * whose box is much larger than itself has no grid, and its cells are
+ * looked up in its rows instead. */
+struct flatgrid
+{
+    CELL *g;
+    size_t *start;		/* the first cell of each row of the flat */
+    char *active;		/* rows that still had unresolved cells */
+    int w, h, c0;
+    int off[8];
+};
+
+/* the code or direction at column col of row r of a flat without a grid,
+ * or 0 if that cell is not in the flat */
+static CELL look_up(const struct flatgrid *fg, const struct flat *f,
+		    const size_t * cell, int r, int col)
 {
-    CELL cvalue;
-    int *active;
-    int offset, isz, i, j, pass, activity, goagain, done;
+    size_t lo, hi, mid;
+
+    if (r < 0 || r >= fg->h)
+	return 0;
+    lo = fg->start[r];
+    hi = fg->start[r + 1];
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (f[cell[mid]].col < col)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo < fg->start[r + 1] && f[cell[lo]].col == col ? f[cell[lo]].dir : 0;
+}
 
-    active = (int *)G_calloc(nl, sizeof(int));
+/* sweep a row of the flat until it stops changing, taking a direction at
+ * each cell with a way out;
+ * returns 1 if anything changed */
+static int sweep_row(struct flatgrid *fg, struct flat *f,
+		     const size_t * cell, int r)
+{
+    CELL out, code, v, *here;
+    size_t k, at;
+    int d, col, goagain, activity;
+
+    if (!fg->active[r])
+	return 0;
+    fg->active[r] = 0;
+    activity = 0;
+    do {
+	goagain = 0;
+	for (k = fg->start[r]; k < fg->start[r + 1]; k += 1) {
+	    col = f[cell[k]].col;
+	    at = (size_t) (r + 1) * fg->w + col - fg->c0 + 1;
+	    here = fg->g != NULL ? fg->g + at : &f[cell[k]].dir;
+	    if (*here >= 0)
+		continue;
+	    code = -*here;
+	    out = f[cell[k]].out;
+	    for (d = 0; d < 8; d += 1) {
+		if (!(code & (1 << d)))
+		    continue;
+		v = fg->g != NULL ? fg->g[at + fg->off[d]] :
+		    look_up(fg, f, cell, r + drow[d], col + dcol[d]);
+		if (v > 0 && v != back[d])
+		    out |= 1 << d;
+	    }
+	    if (out == 0)
+		fg->active[r] = 1;
+	    else {
+		goagain = 1;
+		*here = select_dir(out);
+	    }
+	}
+	if (goagain)
+	    activity = 1;
+    } while (goagain);
 
-    isz = sizeof(CELL);
+    return activity;
+}
 
-    // Address of dirs.
-    char* dirsbuf;
+/* Resolve one flat as the row sweeps over the whole map did: down and then
+ * up through its rows until a pass changes nothing.  Returns 1 if cells
+ * are left unresolved. */
+static int solve_flat(struct flat *f, const size_t * cell, size_t n)
+{
+    struct flatgrid fg;
+    size_t k, at;
+    int r0, c1, h, r, d, activity, left;
+
+    r0 = f[cell[0]].row;
+    fg.h = h = f[cell[n - 1]].row - r0 + 1;
+    fg.c0 = c1 = f[cell[0]].col;
+    for (k = 1; k < n; k += 1) {
+	if (f[cell[k]].col < fg.c0)
+	    fg.c0 = f[cell[k]].col;
+	if (f[cell[k]].col > c1)
+	    c1 = f[cell[k]].col;
+    }
+    fg.w = c1 - fg.c0 + 3;
+    for (d = 0; d < 8; d += 1)
+	fg.off[d] = drow[d] * fg.w + dcol[d];
+
+    fg.g = NULL;
+    if ((size_t) (h + 2) * fg.w <= 4 * n + 64)
+	fg.g = G_calloc((size_t) (h + 2) * fg.w, sizeof(CELL));
+    fg.start = G_malloc((h + 1) * sizeof(size_t));
+    fg.active = G_malloc(h);
+    for (k = 0, r = 0; k < n; k += 1) {
+	while (r <= f[cell[k]].row - r0)
+	    fg.start[r++] = k;
+	at = (size_t) (f[cell[k]].row - r0 + 1) * fg.w + f[cell[k]].col - fg.c0 + 1;
+	if (fg.g != NULL)
+	    fg.g[at] = f[cell[k]].dir;
+    }
+    fg.start[h] = n;
+    memset(fg.active, 1, h);
 
-    /* select a direction when there are multiple non-flat links */
+    do {
+	activity = 0;
+	for (r = 0; r < h; r += 1)
+	    activity |= sweep_row(&fg, f, cell, r);
+	if (!activity)
+	    break;
+	activity = 0;
+	for (r = h - 1; r >= 0; r -= 1)
+	    activity |= sweep_row(&fg, f, cell, r);
+    } while (activity);
+
+    left = 0;
+    for (k = 0; k < n; k += 1) {
+	at = (size_t) (f[cell[k]].row - r0 + 1) * fg.w + f[cell[k]].col - fg.c0 + 1;
+	if (fg.g != NULL)
+	    f[cell[k]].dir = fg.g[at];
+	if (f[cell[k]].dir < 0)
+	    left = 1;
+    }
 
-    dirsbuf = dirs;
+    G_free(fg.g);
+    G_free(fg.start);
+    G_free(fg.active);
+    return left;
+}
 
-    for (i = 1; i < nl - 1; i += 1) {
-    	memcpy(bnd->b[0], dirsbuf, bnd->sz);
-    	dirsbuf += bnd->sz;
+/* sweep row i of the map, held in the middle of the band, until it stops
+ * changing, as sweep_row() does for a flat; returns 1 if anything changed */
+static int flat_links(int i, struct band3 *bnd, struct nullmask *mask,
+		      char *active)
+{
+    CELL *p, out, code, v;
+    int j, d, goagain, activity;
 
-		for (j = 1; j < bnd->ns - 1; j += 1) {
-	    	offset = j * isz;
-	    	if (Rast_is_c_null_value((CELL *) (bnd->b[0] + offset)))
-				continue;
-	    	memcpy(&cvalue, bnd->b[0] + offset, isz);
-	    	if (cvalue > 0)
-				cvalue = select_dir(cvalue);
-	    	memcpy(bnd->b[0] + offset, &cvalue, isz);
-		}
-		dirsbuf -= bnd->sz;
-		memcpy(dirsbuf, bnd->b[0], bnd->sz);
-		dirsbuf += bnd->sz;
+    if (!active[i])
+	return 0;
+    p = (CELL *) bnd->b[1];
+    activity = 0;
+    do {
+	goagain = 0;
+	active[i] = 0;
+	for (j = nullmask_next(mask, i, 1, bnd->ns - 1); j < bnd->ns - 1;
+	     j = nullmask_next(mask, i, j + 1, bnd->ns - 1)) {
+	    if (p[j] >= 0 || p[j] == -256)
+		continue;
+	    code = -p[j];
+	    out = 0;
+	    for (d = 0; d < 8; d += 1) {
+		v = ((CELL *) bnd->b[1 + drow[d]])[j + dcol[d]];
+		if ((code & (1 << d)) && v > 0 && v != back[d])
+		    out |= 1 << d;
+	    }
+	    if (out == 0)
+		active[i] = 1;
+	    else {
+		goagain = 1;
+		p[j] = select_dir(out);
+	    }
+	}
+	if (goagain)
+	    activity = 1;
+    } while (goagain);
 
-    }
+    return activity;
+}
 
-    pass = 0;
-    for (i = 1; i < nl - 1; i += 1)
-		active[i] = 1;
+/* Resolve the flats from row r0 on with down and up sweeps over the map,
+ * for a flat too large to be listed.  Returns 1 if cells are left
+ * unresolved. */
+static int sweep_flats(struct rows *dirs, int r0, int nl, struct band3 *bnd,
+		       struct nullmask *mask)
+{
+    char *active;
+    int i, pass, activity, left;
 
-    /* select a direction when there are multiple flat links */
-    do {
-		done = 1;
-		pass += 1;
+    active = G_calloc(nl, 1);
+    memset(active + r0, 1, nl - 1 - r0);
 
-		activity = 0;
-		G_verbose_message(_("Downward pass %d"), pass);
+    pass = 0;
+    do {
+	G_verbose_message(_("Downward pass %d"), ++pass);
+	activity = 0;
+	advance_band3mem(0, bnd);
+	rows_get(dirs, r0 - 1, bnd->b[2]);
+	advance_band3mem(0, bnd);
+	rows_get(dirs, r0, bnd->b[2]);
+	for (i = r0; i < nl - 1; i += 1) {
+	    advance_band3mem(0, bnd);
+	    rows_get(dirs, i + 1, bnd->b[2]);
+	    if (flat_links(i, bnd, mask, active)) {
+		rows_put(dirs, i, bnd->b[1]);
+		activity = 1;
+	    }
+	}
+	if (!activity)
+	    break;
+
+	G_verbose_message(_("Upward pass %d"), pass);
+	activity = 0;
+	retreat_band3mem(0, bnd);
+	rows_get(dirs, nl - 1, bnd->b[0]);
+	retreat_band3mem(0, bnd);
+	rows_get(dirs, nl - 2, bnd->b[0]);
+	for (i = nl - 2; i >= r0; i -= 1) {
+	    retreat_band3mem(0, bnd);
+	    rows_get(dirs, i - 1, bnd->b[0]);
+	    if (flat_links(i, bnd, mask, active)) {
+		rows_put(dirs, i, bnd->b[1]);
+		activity = 1;
+	    }
+	}
+    } while (activity);
 
-		dirsbuf = dirs;
+    left = 0;
+    for (i = r0; i < nl - 1; i += 1)
+	left |= active[i];
+    G_free(active);
+    return left;
+}
 
-		advance_band3mem(&dirsbuf, bnd);
-		advance_band3mem(&dirsbuf, bnd);
-		for (i = 1; i < nl - 1; i++) {
-			dirsbuf = dirs + (i + 1) * bnd->sz;
+//void resolve(int fd, int nl, struct band3 *bnd)
+void resolve(struct rows* dirs, int nl, struct band3 *bnd, struct nullmask *mask,
+	     off_t limit)
+{
+    CELL cvalue, *p;
+    struct flat *f;
+    struct flatset *set;
+    size_t *rowflat, *cell, cap, want, n, nflat, nsets, a, b;
+    long k;
+    int offset, isz, i, j, r0, r1, next, left;
 
-		    advance_band3mem(&dirsbuf, bnd);
+    isz = sizeof(CELL);
 
-		    if (!active[i])
-				continue;
+    /* select a direction when there are multiple non-flat links, and count
+     * the flat cells of each row for the bands below */
 
-		    done = 0;
-		    active[i] = 0;
-		    do {
-				goagain = 0;
-				for (j = 1; j < bnd->ns - 1; j += 1) {
-				    flink(i, j, nl, bnd->ns,
-					  (CELL *) bnd->b[0], (CELL *) bnd->b[1],
-					  (CELL *) bnd->b[2], &active[i], &goagain);
-				    if (goagain)
-						activity = 1;
-				}
-		    } while (goagain);
-
-		    dirsbuf = dirs + i * bnd->sz;
-		    memcpy(dirsbuf, bnd->b[1], bnd->sz);
-		    dirsbuf += bnd->sz;
+    nflat = 0;
+    rowflat = G_calloc(nl, sizeof(size_t));
 
-		}
+    for (i = 1; i < nl - 1; i += 1) {
+    	rows_get(dirs, i, bnd->b[0]);
 
-		if (!activity) {
-		    G_warning(_("Could not solve for all cells"));
-		    done = 1;
-		    continue;
+		for (j = nullmask_next(mask, i, 1, bnd->ns - 1); j < bnd->ns - 1;
+		     j = nullmask_next(mask, i, j + 1, bnd->ns - 1)) {
+	    	offset = j * isz;
+	    	memcpy(&cvalue, bnd->b[0] + offset, isz);
+	    	if (cvalue > 0)
+				cvalue = select_dir(cvalue);
+	    	else if (cvalue < 0 && cvalue != -256)
+				rowflat[i] += 1;
+	    	memcpy(bnd->b[0] + offset, &cvalue, isz);
 		}
+		rows_put(dirs, i, bnd->b[0]);
+		nflat += rowflat[i];
 
-		activity = 0;
-		G_verbose_message(_("Upward pass %d"), pass);
-
-		dirsbuf = dirs + (nl - 1) * bnd->sz;
+    }
 
-		retreat_band3mem(&dirsbuf, bnd);
-		retreat_band3mem(&dirsbuf, bnd);
-		for (i = nl - 2; i >= 1; i -= 1) {
-			dirsbuf = dirs + (i - 1) * bnd->sz;
+    if (nflat == 0) {
+		G_verbose_message(_("No flat areas to resolve"));
+		G_free(rowflat);
+		return;
+    }
 
-		    retreat_band3mem(&dirsbuf, bnd);
+    /* select a direction when there are multiple flat links, one flat at
+     * a time; the largest are started first so that the small ones fill
+     * in around them.  A flat that reaches the last row of a band may go
+     * on below it and is left for the next band, which starts at its first
+     * row.  When a band cannot hold a whole flat the rest of the map is
+     * swept instead. */
+    cap = limit / FLAT_BYTES;
+    left = 0;
+    for (r0 = 1; r0 < nl - 1; r0 = next) {
+		want = 0;
+		for (r1 = r0; r1 < nl - 1 && want + rowflat[r1] <= cap; r1 += 1)
+		    want += rowflat[r1];
+		next = r1;
+		if (r1 == r0) {
+		    left |= sweep_flats(dirs, r0, nl, bnd, mask);
+		    break;
+		}
+		if (want == 0)
+		    continue;
 
-		    if (!active[i])
+		f = G_malloc(want * sizeof(struct flat));
+		n = list_flats(f, dirs, r0, r1, bnd, mask);
+		cell = G_malloc(n * sizeof(size_t));
+		set = group_flats(f, n, cell, &nsets);
+		for (k = 0; r1 < nl - 1 && k < (long)nsets; k += 1) {
+		    if (f[cell[set[k].first + set[k].n - 1]].row < r1 - 1)
 				continue;
+		    if (f[cell[set[k].first]].row < next)
+				next = f[cell[set[k].first]].row;
+		    set[k].n = 0;
+		}
 
-		    done = 0;
-		    active[i] = 0;
-		    do {
-				goagain = 0;
-				for (j = 1; j < bnd->ns - 1; j++) {
-				    flink(i, j, nl, bnd->ns,
-					  (CELL *) bnd->b[0], (CELL *) bnd->b[1],
-					  (CELL *) bnd->b[2], &active[i], &goagain);
-				    if (goagain)
-						activity = 1;
-				}
-		    } while (goagain);
-
-		    dirsbuf = dirs + i * bnd->sz;
-		    memcpy(dirsbuf, bnd->b[1], bnd->sz);
-		    dirsbuf += bnd->sz;
+		if (next == r0) {
+		    G_free(set);
+		    G_free(cell);
+		    G_free(f);
+		    left |= sweep_flats(dirs, r0, nl, bnd, mask);
+		    break;
 		}
 
-		if (!activity) {
-		    G_warning(_("Could not solve for all cells"));
-		    done = 1;
+		G_verbose_message(_("Resolving %lu flats of %lu cells"),
+				  (unsigned long)nsets, (unsigned long)n);
+#pragma omp parallel for schedule(dynamic) reduction(|:left)
+		for (k = 0; k < (long)nsets; k += 1)
+		    if (set[k].n > 0)
+				left |= solve_flat(f, cell + set[k].first, set[k].n);
+
+		/* write the directions back, a row at a time; the cells of
+		 * flats left for the next band are written unchanged */
+		for (a = 0; a < n; a = b) {
+		    i = f[a].row;
+		    rows_get(dirs, i, bnd->b[0]);
+		    p = (CELL *) bnd->b[0];
+		    for (b = a; b < n && f[b].row == i; b += 1)
+				p[f[b].col] = f[b].dir;
+		    rows_put(dirs, i, bnd->b[0]);
 		}
 
-    } while (!done);
+		G_free(set);
+		G_free(cell);
+		G_free(f);
+    }
 
-    G_free(active);
+    if (left)
+		G_warning(_("Could not solve for all cells"));
+
+    G_free(rowflat);
 
     return;
 
@@ -0,0 +1,331 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <grass/gis.h>
+#include <grass/raster.h>
+#include <grass/glocale.h>
+#include "tinf.h"
+#include "ds.h"
+#include "local.h"
+
+/* A fill service for many small requests on the same large map.  The
+ * region is read once and kept; each request names a window of it, which
+ * is copied to scratch buffers kept from one request to the next, run
+ * through the stages as a map of that extent would be, and sent back as
+ * raw rows.  Requests are taken one at a time over a Unix domain socket,
+ * as many per connection as the client likes.  All numbers are in native
+ * byte order. */
+
+#define SERVE_MAGIC 0x53444652	/* "RFDS" */
+
+#define SERVE_FILL 1		/* fill the window */
+#define SERVE_WATERSHED 2	/* find the watershed of each sink */
+#define SERVE_STOP 3		/* end the service */
+
+#define SERVE_ELEV 1		/* rows of elevations */
+#define SERVE_DIRS 2		/* rows of directions, as CELL */
+#define SERVE_AREAS 4		/* rows of basin numbers, as CELL */
+
+#define SERVE_OK 0
+#define SERVE_BAD_REQUEST 1
+#define SERVE_BAD_WINDOW 2
+
+struct serve_req
+{
+    int magic;
+    int mode;			/* SERVE_FILL or SERVE_WATERSHED */
+    int what;			/* SERVE_ELEV | SERVE_DIRS | SERVE_AREAS */
+    int row, col;		/* first row and column in the region */
+    int nrows, ncols;
+};
+
+struct serve_reply
+{
+    int status;			/* SERVE_OK or the reason for refusing */
+    int nrows, ncols;
+    int type;			/* cell type of the elevations */
+    int nbasins;		/* problem areas, or watersheds */
+};
+
+/* the map and the scratch kept between requests */
+struct service
+{
+    char *dem;
+    int nrows, ncols, type;
+    char *elev, *dirs;
+    size_t elevsz, dirsz;
+    CELL *row;
+    const CELL *table;		/* direction codes in the output format */
+    int gradient, parallel, coarse, nprocs;
+};
+
+static volatile sig_atomic_t stopping;
+
+static void stop(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+static int read_all(int fd, void *buf, size_t n)
+{
+    char *p = buf;
+    ssize_t k;
+
+    while (n > 0) {
+	if ((k = read(fd, p, n)) <= 0) {
+	    if (k < 0 && errno == EINTR && !stopping)
+		continue;
+	    return 0;
+	}
+	p += k;
+	n -= k;
+    }
+    return 1;
+}
+
+static int write_all(int fd, const void *buf, size_t n)
+{
+    const char *p = buf;
+    ssize_t k;
+
+    while (n > 0) {
+	if ((k = write(fd, p, n)) <= 0) {
+	    if (k < 0 && errno == EINTR)
+		continue;
+	    return 0;
+	}
+	p += k;
+	n -= k;
+    }
+    return 1;
+}
+
+/* Run the stages on a window, leaving the elevations and directions in
+ * the scratch buffers and the basins in prob.  Returns the number of
+ * basins. */
+static int fill_window(struct service *s, const struct serve_req *q,
+		       struct spans *prob)
+{
+    struct band3 bnd, bndC;
+    struct nullmask *mask;
+    struct rows dirs;
+    size_t elevsz, dirsz;
+    off_t flats;
+    int i, j, nbasins;
+
+    elevsz = (size_t) q->nrows * q->ncols * bpe();
+    dirsz = (size_t) q->nrows * q->ncols * sizeof(CELL);
+    /* the flat lists get as much as fill_map() gives them */
+    flats = dirsz;
+    if (elevsz > s->elevsz) {
+	s->elev = G_realloc(s->elev, elevsz);
+	s->elevsz = elevsz;
+    }
+    if (dirsz > s->dirsz) {
+	s->dirs = G_realloc(s->dirs, dirsz);
+	s->dirsz = dirsz;
+    }
+
+    mask = nullmask_init(q->nrows, q->ncols);
+    for (i = 0; i < q->nrows; i += 1) {
+	memcpy(s->elev + (size_t) i * q->ncols * bpe(),
+	       s->dem + ((size_t) (q->row + i) * s->ncols + q->col) * bpe(),
+	       q->ncols * bpe());
+	for (j = 0; j < q->ncols; j += 1) {
+	    if (is_null(s->elev + ((size_t) i * q->ncols + j) * bpe()))
+		nullmask_set(mask, i, j);
+	}
+    }
+
+    bndC.ns = q->ncols;
+    bndC.sz = sizeof(CELL) * q->ncols;
+    bnd.ns = q->ncols;
+    bnd.sz = q->ncols * bpe();
+    dirs.buf = s->dirs;
+    dirs.z = NULL;
+    dirs.sz = bndC.sz;
+    for (i = 0; i < 3; i += 1) {
+	bndC.b[i] = G_calloc(q->ncols, sizeof(CELL));
+	bnd.b[i] = G_calloc(q->ncols, bpe());
+    }
+
+    if (q->mode == SERVE_FILL) {
+	if (s->coarse > 1)
+	    cflood(s->elev, q->nrows, q->ncols, mask, s->coarse);
+	if (s->gradient)
+	    eflood(s->elev, q->nrows, q->ncols, mask);
+	if (s->parallel)
+	    pflood(s->elev, s->dirs, q->nrows, q->ncols, mask, s->nprocs);
+    }
+    filldir(s->elev, &dirs, q->nrows, &bnd, mask);
+    resolve(&dirs, q->nrows, &bndC, mask, flats);
+    nbasins = dopolys(&dirs, prob, q->nrows, q->ncols, mask);
+    if (nbasins > 0)
+	wtrshed(prob, &dirs, q->nrows, q->ncols, wtrshed_size(q->nrows, q->ncols));
+
+    // A fill ends as fill_map() does, with the problem areas left.
+    if (q->mode == SERVE_FILL && nbasins > 0) {
+	ppupdate(s->elev, prob, q->nrows, nbasins, &bnd, &bndC, mask, NULL);
+	filldir(s->elev, &dirs, q->nrows, &bnd, mask);
+	resolve(&dirs, q->nrows, &bndC, mask, flats);
+	nbasins = dopolys(&dirs, prob, q->nrows, q->ncols, mask);
+    }
+
+    for (i = 0; i < 3; i += 1) {
+	G_free(bndC.b[i]);
+	G_free(bnd.b[i]);
+    }
+    nullmask_free(mask);
+    return nbasins;
+}
+
+/* answer one request; returns 0 when the client has gone */
+static int answer(struct service *s, int fd, const struct serve_req *q)
+{
+    struct serve_reply r;
+    struct spans *prob;
+    CELL *dir;
+    int i, j, ok;
+
+    r.status = SERVE_OK;
+    r.nrows = r.ncols = r.nbasins = 0;
+    r.type = s->type;
+    if (q->magic != SERVE_MAGIC)
+	r.status = SERVE_BAD_REQUEST;
+    else if (q->mode == SERVE_STOP)
+	return write_all(fd, &r, sizeof(r));
+    else if ((q->mode != SERVE_FILL && q->mode != SERVE_WATERSHED) ||
+	     (q->what & ~(SERVE_ELEV | SERVE_DIRS | SERVE_AREAS)))
+	r.status = SERVE_BAD_REQUEST;
+    else if (q->row < 0 || q->col < 0 || q->nrows < 3 || q->ncols < 3 ||
+	     q->nrows > s->nrows - q->row || q->ncols > s->ncols - q->col)
+	r.status = SERVE_BAD_WINDOW;
+    if (r.status != SERVE_OK)
+	return write_all(fd, &r, sizeof(r)) && q->magic == SERVE_MAGIC;
+
+    G_verbose_message(_("Request for %d rows and %d columns at %d,%d"),
+		      q->nrows, q->ncols, q->row, q->col);
+    prob = spans_init(q->nrows, q->ncols);
+    r.nbasins = fill_window(s, q, prob);
+    r.nrows = q->nrows;
+    r.ncols = q->ncols;
+
+    ok = write_all(fd, &r, sizeof(r));
+    if (ok && (q->what & SERVE_ELEV))
+	ok = write_all(fd, s->elev, (size_t) q->nrows * q->ncols * bpe());
+    for (i = 0; ok && (q->what & SERVE_DIRS) && i < q->nrows; i += 1) {
+	dir = (CELL *) s->dirs + (size_t) i * q->ncols;
+	for (j = 0; j < q->ncols; j += 1)
+	    s->row[j] =
+		(unsigned int)dir[j] < 256 ? s->table[dir[j]] : dir[j];
+	ok = write_all(fd, s->row, q->ncols * sizeof(CELL));
+    }
+    for (i = 0; ok && (q->what & SERVE_AREAS) && i < q->nrows; i += 1) {
+	spans_get_row(prob, i, s->row);
+	ok = write_all(fd, s->row, q->ncols * sizeof(CELL));
+    }
+
+    spans_free(prob);
+    return ok;
+}
+
+/* Serve fills of windows of input on the socket path until interrupted or
+ * asked to stop.  table recodes the directions to the output format. */
+void serve(const char *input, const char *path, const CELL *table,
+	   int gradient, int parallel, int coarse, int nprocs)
+{
+    struct service s;
+    struct serve_req q;
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct stat st;
+    int map_id, fd, c, i, more;
+
+    memset(&s, 0, sizeof(s));
+    s.table = table;
+    s.gradient = gradient;
+    s.parallel = parallel;
+    s.coarse = coarse;
+    s.nprocs = nprocs;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+	G_fatal_error(_("Socket path <%s> is too long"), path);
+    strcpy(addr.sun_path, path);
+
+    // The map is read before the socket exists, so that a client that
+    // finds the socket can be served at once.
+    map_id = Rast_open_old(input, "");
+    s.type = Rast_get_map_type(map_id);
+    set_func_pointers(s.type);
+    s.nrows = Rast_window_rows();
+    s.ncols = Rast_window_cols();
+    s.dem = G_malloc((size_t) s.nrows * s.ncols * bpe());
+    s.row = G_malloc(s.ncols * sizeof(CELL));
+    G_message(_("Reading input elevation raster map..."));
+    for (i = 0; i < s.nrows; i += 1) {
+	G_percent(i, s.nrows, 2);
+	get_row(map_id, s.dem + (size_t) i * s.ncols * bpe(), i);
+    }
+    G_percent(1, 1, 1);
+    Rast_close(map_id);
+
+    // A socket left by a service that died is replaced. One that still
+    // takes connections, or anything else, is not touched.
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	    G_fatal_error(_("Unable to create a socket: %s"), strerror(errno));
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+	    close(fd);
+	    G_fatal_error(_("<%s> is already being served"), path);
+	}
+	if (errno == ECONNREFUSED)
+	    unlink(path);
+	close(fd);
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	listen(fd, 16) != 0)
+	G_fatal_error(_("Unable to listen on <%s>: %s"), path, strerror(errno));
+
+    // Interrupts end the service between requests rather than in one.
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    G_important_message(_("Serving <%s> on <%s>"), input, path);
+    while (!stopping) {
+	if ((c = accept(fd, NULL, NULL)) < 0) {
+	    if (errno != EINTR)
+		G_warning(_("Unable to accept a connection: %s"), strerror(errno));
+	    continue;
+	}
+	more = 1;
+	while (more && !stopping && read_all(c, &q, sizeof(q))) {
+	    more = answer(&s, c, &q);
+	    if (q.magic == SERVE_MAGIC && q.mode == SERVE_STOP)
+		stopping = 1;
+	}
+	close(c);
+    }
+
+    close(fd);
+    unlink(path);
+    G_message(_("Service on <%s> stopped"), path);
+
+    G_free(s.dem);
+    G_free(s.row);
+    G_free(s.elev);
+    G_free(s.dirs);
+}
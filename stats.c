@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <grass/gis.h>
+#include <grass/raster.h>
+#include <grass/glocale.h>
+#include "tinf.h"
+#include "ds.h"
+#include "local.h"
+
+/* write the per-basin spill statistics collected by ppupdate() as CSV.
+ * Bounding boxes are converted from rows and columns, which start at row0
+ * and col0 of the region, to the edges of the outermost cells; volumes are
+ * fill depths times the cell area */
+void write_stats(char *name, struct basin_stats *stats, int nbasins,
+		 int row0, int col0, struct Cell_head *window)
+{
+    int i;
+    FILE *fp;
+    double area;
+
+    if (!(fp = fopen(name, "w")))
+	G_fatal_error(_("Unable to open <%s> for writing: %s"), name,
+		      strerror(errno));
+
+    G_begin_cell_area_calculations();
+
+    fprintf(fp, "basin,cells,spill,next,volume,north,south,west,east\n");
+    for (i = 1; i <= nbasins; i += 1) {
+	if (stats[i].cells == 0)
+	    continue;
+	area = G_area_of_cell_at_row(row0 + (stats[i].n + stats[i].s) / 2);
+	fprintf(fp, "%d,%ld,%.15g,%d,%.15g,%.15g,%.15g,%.15g,%.15g\n", i,
+		(long)stats[i].cells, stats[i].spill, stats[i].next,
+		stats[i].volume * area,
+		Rast_row_to_northing(row0 + stats[i].n, window),
+		Rast_row_to_northing(row0 + stats[i].s + 1, window),
+		Rast_col_to_easting(col0 + stats[i].w, window),
+		Rast_col_to_easting(col0 + stats[i].e + 1, window));
+    }
+
+    if (fclose(fp) != 0)
+	G_fatal_error(_("Error writing <%s>: %s"), name, strerror(errno));
+}
@@ -0,0 +1,165 @@
+"""Generated elevation maps for the regression checks and benchmarks.
+
+Every map is built with integer arithmetic only, so the same cells come out
+on every machine and the golden checksums stay valid. Each generator takes
+the size of the map and returns its rows as lists of ints.
+"""
+
+
+class Lcg:
+    """64-bit linear congruential generator, for noise that does not depend
+    on the Python version."""
+
+    def __init__(self, seed):
+        self.state = seed
+
+    def next(self, n):
+        self.state = (self.state * 6364136223846793005 + 1442695040888963407) % (1 << 64)
+        return (self.state >> 33) % n
+
+
+def terrain(rows, cols, seed=1):
+    """A tilted surface with round hills and hollows and a little noise, so
+    that there are many small pits and flats of all shapes."""
+    rnd = Lcg(seed)
+    z = [[2000 + 3 * i + 2 * j for j in range(cols)] for i in range(rows)]
+    for _ in range(max(8, rows * cols // 4000)):
+        ci, cj = rnd.next(rows), rnd.next(cols)
+        s = 5 + rnd.next(max(1, min(rows, cols) // 6))
+        a = rnd.next(601) - 300
+        for i in range(max(0, ci - s), min(rows, ci + s + 1)):
+            for j in range(max(0, cj - s), min(cols, cj + s + 1)):
+                d2 = (i - ci) ** 2 + (j - cj) ** 2
+                if d2 < s * s:
+                    z[i][j] += a * (s * s - d2) // (s * s)
+    for i in range(rows):
+        for j in range(cols):
+            z[i][j] += rnd.next(7) - 3
+    return z
+
+
+def flats(rows, cols):
+    """A wide plateau with one outlet on the right edge, cut into long
+    diagonal strips by low walls. Each strip is a flat whose bounding box
+    is much larger than the flat, and a lower box in the middle is one
+    large flat of its own."""
+    z = []
+    for i in range(rows):
+        row = []
+        for j in range(cols):
+            if i == 0 or j == 0 or i == rows - 1 or j == cols - 1:
+                v = 100
+            elif rows // 3 < i < 2 * rows // 3 and cols // 3 < j < 2 * cols // 3:
+                v = 40
+            elif (i + j) % 53 == 0:
+                v = 51
+            else:
+                v = 50
+            row.append(v)
+        z.append(row)
+    z[rows // 2][cols - 1] = 10
+    return z
+
+
+def spiral(n):
+    """A corridor one cell wide that winds in a square spiral from an
+    outlet on the left edge to a pit in the middle, between walls. The
+    floor falls toward the middle, so the whole corridor is one depression
+    with the longest possible flow path, and filling it leaves one flat
+    that has to be resolved from the outlet all the way in."""
+    path = [(1, 0), (1, 1)]
+    seen = {(1, 1)}
+    steps = ((0, 1), (1, 0), (0, -1), (-1, 0))
+    d = 0
+
+    def open_ahead(r, c, d):
+        dr, dc = steps[d]
+        r1, c1 = r + dr, c + dc
+        if not (1 <= r1 <= n - 2 and 1 <= c1 <= n - 2):
+            return False
+        return (r1, c1) not in seen and (r1 + dr, c1 + dc) not in seen
+
+    r, c = 1, 1
+    while True:
+        if not open_ahead(r, c, d):
+            d = (d + 1) % 4
+            if not open_ahead(r, c, d):
+                break
+        r, c = r + steps[d][0], c + steps[d][1]
+        seen.add((r, c))
+        path.append((r, c))
+    top = 100 + len(path) // 3
+    z = [[top + 10] * n for _ in range(n)]
+    for k, (r, c) in enumerate(path):
+        z[r][c] = 100 + (len(path) - k) // 3
+    return z
+
+
+def pits(n):
+    """Pits inside pits: four nests of rings on a gentle slope, each ring
+    lower inside and with a raised rim, and single-cell pits scattered over
+    the rest."""
+    rnd = Lcg(7)
+    z = [[500 + i // 8 for j in range(n)] for i in range(n)]
+    for ci, cj, depth in ((n // 4, n // 4, 3), (n // 4, 3 * n // 4, 5),
+                          (3 * n // 4, n // 4, 4), (3 * n // 4, 3 * n // 4, 6)):
+        rad = n // 5
+        for _ in range(depth):
+            for i in range(max(0, ci - rad - 1), min(n, ci + rad + 2)):
+                for j in range(max(0, cj - rad - 1), min(n, cj + rad + 2)):
+                    d2 = (i - ci) ** 2 + (j - cj) ** 2
+                    if d2 < rad * rad:
+                        z[i][j] -= 20
+                    elif d2 < (rad + 1) * (rad + 1):
+                        z[i][j] += 15
+            rad = rad * 3 // 4
+    for i in range(1, n - 1):
+        for j in range(1, n - 1):
+            if rnd.next(100) == 0:
+                z[i][j] -= 3
+    return z
+
+
+def nested(n):
+    """A pit inside a basin: a floor at 100 walled in at 120, with a pit of
+    four by four cells in the middle whose rim is at 105 and whose bottom
+    is at 90. The pit overflows into the floor at 105, and the floor off
+    the map at 120."""
+    z = [[120 if i in (0, n - 1) or j in (0, n - 1) else 100
+          for j in range(n)] for i in range(n)]
+    c = n // 2 - 2
+    for i in range(c, c + 4):
+        for j in range(c, c + 4):
+            z[i][j] = 90 if c < i < c + 3 and c < j < c + 3 else 105
+    return z
+
+
+def write_ascii(path, z):
+    """Write a map in the form r.in.ascii reads, one cell to a unit."""
+    rows, cols = len(z), len(z[0])
+    with open(path, "w") as f:
+        f.write("north: %d\nsouth: 0\neast: %d\nwest: 0\nrows: %d\ncols: %d\n"
+                % (rows, cols, rows, cols))
+        for row in z:
+            f.write(" ".join(str(v) for v in row))
+            f.write("\n")
+
+
+# name, generator, arguments; the regression checks use the small sizes
+# and the benchmarks the large ones
+SMALL = (
+    ("terrain", terrain, (120, 150)),
+    ("flats", flats, (100, 140)),
+    ("spiral", spiral, (101,)),
+    ("pits", pits, (128,)),
+)
+
+LARGE = (
+    ("terrain", terrain, (1200, 1500)),
+    ("flats", flats, (1000, 1400)),
+    ("spiral", spiral, (801,)),
+    ("pits", pits, (1024,)),
+)
+
+# the map the hierarchy queries are checked on
+NESTED = ("nested", nested, (12,))
@@ -0,0 +1,150 @@
+/* Times the priority queue of ds.c with and without its buckets, and the
+ * bare heap, on a priority flood of generated elevations, as flood.c runs
+ * it. Every queue must fill to the same levels.
+ *
+ *     pqbench [rows cols]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../ds.h"
+
+static unsigned long long state;
+
+static unsigned long lcg(unsigned long n) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned long) (state >> 33) % n;
+}
+
+/* the kinds of elevations the flood is timed on */
+enum { ROUGH, FLAT, WIDE, NKINDS };
+
+static const char* kind_name[NKINDS] = {
+    "rough surface", "wide flats", "keys over 65536 apart"
+};
+
+static void make_dem(int kind, double* elev, int nl, int ns) {
+    int i, j;
+
+    state = 1;
+    for(i = 0; i < nl; ++i) {
+        for(j = 0; j < ns; ++j) {
+            double* z = elev + (off_t) i * ns + j;
+            switch(kind) {
+            case ROUGH:
+                *z = 2000 + 3 * i + 2 * j + (long) lcg(7) - 3;
+                break;
+            case FLAT:
+                *z = (i + j) % 53 == 0 ? 51 : 50;
+                break;
+            default:
+                *z = lcg(1000000);
+            }
+        }
+    }
+}
+
+/* which queue a flood uses */
+enum { BUCKETS, HEAP_PQ, HEAP, NQUEUES };
+
+static const char* queue_name[NQUEUES] = { "bucketed pq", "pq on heap", "heap" };
+
+static double now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Raise every cell to the lowest level it can drain from, starting at the
+ * edges. Returns the sum of the levels. */
+static double flood(int queue, const double* elev, double* level, char* done, int nl, int ns) {
+    struct pq q;
+    struct heap h = { 0 };
+    off_t c, n, k, cells = (off_t) nl * ns;
+    double sum = 0;
+    int i, j, di, dj;
+
+    pq_init(&q, queue == BUCKETS);
+    for(k = 0; k < cells; ++k)
+        done[k] = 0;
+
+    for(k = 0; k < cells; ++k) {
+        i = k / ns;
+        j = k % ns;
+        if(i > 0 && i < nl - 1 && j > 0 && j < ns - 1)
+            continue;
+        level[k] = elev[k];
+        done[k] = 1;
+        if(queue == HEAP)
+            heap_push(&h, level[k], k);
+        else
+            pq_push(&q, level[k], k);
+    }
+
+    while(queue == HEAP ? h.n > 0 : pq_size(&q) > 0) {
+        c = queue == HEAP ? heap_pop(&h) : pq_pop(&q);
+        sum += level[c];
+        i = c / ns;
+        j = c % ns;
+        for(di = -1; di <= 1; ++di) {
+            for(dj = -1; dj <= 1; ++dj) {
+                if(i + di < 0 || i + di >= nl || j + dj < 0 || j + dj >= ns)
+                    continue;
+                n = c + (off_t) di * ns + dj;
+                if(done[n])
+                    continue;
+                done[n] = 1;
+                level[n] = elev[n] > level[c] ? elev[n] : level[c];
+                if(queue == HEAP)
+                    heap_push(&h, level[n], n);
+                else
+                    pq_push(&q, level[n], n);
+            }
+        }
+    }
+
+    pq_free(&q);
+    heap_free(&h);
+    return sum;
+}
+
+int main(int argc, char** argv) {
+    int nl = 1000, ns = 1000, kind, queue, failed = 0;
+    double *elev, *level, sum[NQUEUES], t;
+    char* done;
+
+    if(argc == 3) {
+        nl = atoi(argv[1]);
+        ns = atoi(argv[2]);
+    }
+    if(nl < 3 || ns < 3) {
+        fprintf(stderr, "usage: pqbench [rows cols]\n");
+        return 2;
+    }
+    elev = malloc((size_t) nl * ns * sizeof(double));
+    level = malloc((size_t) nl * ns * sizeof(double));
+    done = malloc((size_t) nl * ns);
+
+    printf("Priority flood of %d by %d cells, ns per cell\n", nl, ns);
+    for(kind = 0; kind < NKINDS; ++kind) {
+        make_dem(kind, elev, nl, ns);
+        printf("%-22s", kind_name[kind]);
+        for(queue = 0; queue < NQUEUES; ++queue) {
+            t = now();
+            sum[queue] = flood(queue, elev, level, done, nl, ns);
+            t = now() - t;
+            printf("  %s %6.1f", queue_name[queue], t * 1e9 / ((double) nl * ns));
+        }
+        printf("\n");
+        if(sum[HEAP_PQ] != sum[BUCKETS] || sum[HEAP] != sum[BUCKETS]) {
+            printf("  the queues filled to different levels\n");
+            failed = 1;
+        }
+    }
+
+    free(elev);
+    free(level);
+    free(done);
+    return failed;
+}
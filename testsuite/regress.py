@@ -0,0 +1,294 @@
+#!/usr/bin/env python3
+"""Regression checks and benchmarks for r.fill.dir.
+
+    regress.py check [--update] [--large]
+    regress.py bench [--update] [--tolerance F]
+
+Both run inside a GRASS session. They import the generated maps of
+corpus.py, run the module on them with -t and read the checksums and stage
+times it reports.
+
+check runs the small maps with each set of flags in FLAGS and fails when a
+checksum differs from golden.txt. It also saves the hierarchy of the nested
+map and fails when a query in QUERIES fills it to other levels. With
+--large, or REGRESS_LARGE=1 in the environment, it also fills a raw grid of
+more than 2^31 cells, which needs LARGE_MEMORY bytes free. bench runs
+the large maps a few times each and fails when a checksum differs from
+baseline.txt, or when the total time is more than F times the stored one
+(1.25 by default). The stored times only mean something on the machine
+they were taken on. --update rewrites the file from this build instead of
+comparing with it.
+"""
+
+import os
+import re
+import struct
+import subprocess
+import sys
+import tempfile
+
+import corpus
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+GOLDEN = os.path.join(HERE, "golden.txt")
+BASELINE = os.path.join(HERE, "baseline.txt")
+
+# the flags each small map is checked with; -p is run on one thread and on
+# several, which must give the same maps
+FLAGS = ("", "-e", "-p nprocs=1", "-p nprocs=3", "-z")
+
+# the types each small map is checked as
+TYPES = ("CELL", "FCELL", "DCELL")
+
+# the queries run on the hierarchy of the nested map, each with the levels
+# it must raise the cells of each elevation to; the other cells are kept
+QUERIES = (
+    ("size", 20, {90: 105}),
+    ("level", 102, {90: 102, 100: 102}),
+    ("level", 110, {90: 110, 100: 110, 105: 110}),
+)
+
+# The raw grid of the large check: more than 2^31 cells, with rows past
+# cell 2^31, filled in place from a sparse file of nulls with two pits,
+# one near the start and one near the end. Each pit is a cell at 3 inside
+# a block of cells at 10, which it must be filled to.
+LARGE_ROWS, LARGE_COLS = 50000, 46000
+LARGE_PITS = ((1, 1), (LARGE_ROWS - 4, LARGE_COLS - 6))
+LARGE_MEMORY = 16 * LARGE_ROWS * LARGE_COLS
+
+# the flags each large map is timed with, and how many runs to take the
+# best of
+BENCH_FLAGS = ("", "-p nprocs=4")
+RUNS = 3
+
+# times under this many seconds are too short to compare
+SLACK = 0.05
+
+PREFIX = "rfd_regress"
+
+STAGE = re.compile(r"^(.+): ([0-9.]+) seconds$")
+CHECKSUM = re.compile(r"^Checksum of <([^>]+)>: ([0-9a-f]{16})$")
+
+
+def run(*args, **kw):
+    env = dict(os.environ, GRASS_MESSAGE_FORMAT="plain", LC_ALL="C", LANG="C")
+    env.update(kw)
+    p = subprocess.run(args, env=env, stdout=subprocess.PIPE,
+                       stderr=subprocess.STDOUT, universal_newlines=True)
+    if p.returncode != 0:
+        sys.stderr.write(p.stdout)
+        sys.exit("%s failed" % args[0])
+    return p.stdout
+
+
+def import_map(tmp, name, z, cell_type):
+    """Import a generated map and save its region, leaving the current one
+    alone. Returns the name of the map."""
+    path = os.path.join(tmp, name + ".asc")
+    corpus.write_ascii(path, z)
+    map_name = "%s_%s_%s" % (PREFIX, name, cell_type.lower())
+    run("r.in.ascii", "--overwrite", "--quiet", "input=" + path,
+        "output=" + map_name, "type=" + cell_type)
+    run("g.region", "-u", "--overwrite", "raster=" + map_name,
+        "save=" + PREFIX)
+    return map_name
+
+
+def fill(map_name, flags):
+    """Fill a map and return the checksums of the three outputs and the
+    time of each stage."""
+    out = [PREFIX + "_" + s for s in ("filled", "dirs", "areas")]
+    log = run("r.fill.dir", "--overwrite", "-t", "input=" + map_name,
+              "output=" + out[0], "direction=" + out[1], "areas=" + out[2],
+              *flags.split(), WIND_OVERRIDE=PREFIX)
+    sums, stages = {}, []
+    for line in log.splitlines():
+        m = CHECKSUM.match(line.strip())
+        if m:
+            sums[m.group(1)] = m.group(2)
+            continue
+        m = STAGE.match(line.strip())
+        if m:
+            stages.append((m.group(1), float(m.group(2))))
+    return " ".join(sums.get(o, "-") for o in out), stages
+
+
+def query(tmp, cell_type):
+    """Save the hierarchy of the nested map and check the queries on it.
+    Returns the number of queries that failed."""
+    name, make, size = corpus.NESTED
+    z = make(*size)
+    map_name = import_map(tmp, name, z, cell_type)
+    hier = os.path.join(tmp, "hierarchy")
+    out = PREFIX + "_query"
+    fill(map_name, "hierarchy=" + hier)
+    failed = 0
+    for mode, value, levels in QUERIES:
+        run("r.fill.dir", "--overwrite", "hierarchy=" + hier, "query=" + mode,
+            "value=%s" % value, "input=" + map_name, "output=" + out,
+            WIND_OVERRIDE=PREFIX)
+        got = [[float(v) for v in line.split()] for line in
+               run("r.out.ascii", "-h", "input=" + out, "output=-").splitlines()]
+        want = [[levels.get(v, v) for v in row] for row in z]
+        key = "%s %s query=%s value=%s" % (name, cell_type, mode, value)
+        if got != want:
+            print("FAIL %s" % key)
+            failed += 1
+        else:
+            print("ok   %s" % key)
+    return failed
+
+
+def mem_available():
+    try:
+        with open("/proc/meminfo") as f:
+            for line in f:
+                if line.startswith("MemAvailable:"):
+                    return int(line.split()[1]) * 1024
+    except OSError:
+        pass
+    return 0
+
+
+def large(tmp):
+    """Fill the large raw grid and check the filled map. Returns the number
+    of checks that failed."""
+    if mem_available() < LARGE_MEMORY:
+        print("skip large: needs %d GiB free" % (LARGE_MEMORY >> 30))
+        return 0
+    path = os.path.join(tmp, "large.raw")
+    with open(path, "wb") as f:
+        for r, c in LARGE_PITS:
+            for i in range(r - 1, r + 2):
+                f.seek(4 * (i * LARGE_COLS + c - 1))
+                f.write(struct.pack("<3i", 10, 3 if i == r else 10, 10))
+        f.truncate(4 * LARGE_ROWS * LARGE_COLS)
+    run("g.region", "--overwrite", "n=%d" % LARGE_ROWS, "s=0", "w=0",
+        "e=%d" % LARGE_COLS, "res=1", "save=" + PREFIX)
+    out = PREFIX + "_large"
+    run("r.fill.dir", "--overwrite", "rawin=" + path, "rawtype=CELL",
+        "nodata=0", "output=" + out, "direction=" + PREFIX + "_dirs",
+        WIND_OVERRIDE=PREFIX)
+    stats = dict(line.split("=", 1) for line in run(
+        "r.univar", "-g", "map=" + out, WIND_OVERRIDE=PREFIX).splitlines()
+        if "=" in line)
+    want = {"n": 9 * len(LARGE_PITS), "min": 10, "max": 10}
+    if any(float(stats.get(k, "nan")) != v for k, v in want.items()):
+        print("FAIL large: n=%s min=%s max=%s, expected %s" % (
+            stats.get("n"), stats.get("min"), stats.get("max"), want))
+        return 1
+    print("ok   large")
+    return 0
+
+
+def cleanup():
+    run("g.remove", "-f", "--quiet", "type=raster", "pattern=%s_*" % PREFIX)
+    run("g.remove", "-f", "--quiet", "type=region", "name=" + PREFIX)
+
+
+def read_table(path):
+    table = {}
+    if os.path.exists(path):
+        with open(path) as f:
+            for line in f:
+                if line.strip() and not line.startswith("#"):
+                    key, value = line.rstrip("\n").split("\t", 1)
+                    table[key] = value
+    return table
+
+
+def write_table(path, header, table):
+    with open(path, "w") as f:
+        f.write(header)
+        for key, value in table.items():
+            f.write("%s\t%s\n" % (key, value))
+
+
+def check(update, with_large):
+    golden = read_table(GOLDEN)
+    found = {}
+    failed = 0
+    with tempfile.TemporaryDirectory() as tmp:
+        for name, make, size in corpus.SMALL:
+            z = make(*size)
+            for cell_type in TYPES:
+                map_name = import_map(tmp, name, z, cell_type)
+                for flags in FLAGS:
+                    key = "%s %s %s" % (name, cell_type, flags or "-")
+                    found[key], _ = fill(map_name, flags)
+                    if update:
+                        continue
+                    if found[key] != golden.get(key):
+                        print("FAIL %s: %s, expected %s" % (key, found[key], golden.get(key)))
+                        failed += 1
+                    else:
+                        print("ok   %s" % key)
+        for cell_type in TYPES:
+            failed += query(tmp, cell_type)
+        if with_large:
+            failed += large(tmp)
+    cleanup()
+    if update:
+        write_table(GOLDEN, "# case type flags\tchecksums of the filled, direction and areas maps\n", found)
+        print("Wrote %d checksums to %s" % (len(found), GOLDEN))
+    elif failed:
+        sys.exit("%d of %d checks failed" % (failed, len(found) + len(TYPES) * len(QUERIES)
+                                              + (1 if with_large else 0)))
+
+
+def bench(update, tolerance):
+    baseline = read_table(BASELINE)
+    found = {}
+    failed = 0
+    with tempfile.TemporaryDirectory() as tmp:
+        for name, make, size in corpus.LARGE:
+            map_name = import_map(tmp, name, make(*size), "CELL")
+            for flags in BENCH_FLAGS:
+                key = "%s %s" % (name, flags or "-")
+                best = None
+                for _ in range(RUNS):
+                    sums, stages = fill(map_name, flags)
+                    total = sum(t for _, t in stages)
+                    if best is None or total < best[0]:
+                        best = (total, stages)
+                total, stages = best
+                found[key] = "%.3f\t%s\t%s" % (total, sums, " ".join(
+                    "%s=%.3f" % (s.replace(" ", "_"), t) for s, t in stages))
+                line = "%-22s %8.3f s  %s" % (key, total, found[key].split("\t")[2])
+                if update or key not in baseline:
+                    print("     " + line)
+                    continue
+                old_total, old_sums, _ = baseline[key].split("\t")
+                if sums != old_sums:
+                    print("FAIL " + line + "  (output changed)")
+                    failed += 1
+                elif total > tolerance * float(old_total) + SLACK:
+                    print("FAIL " + line + "  (was %s s)" % old_total)
+                    failed += 1
+                else:
+                    print("ok   " + line + "  (was %s s)" % old_total)
+    cleanup()
+    if update:
+        write_table(BASELINE, "# case flags\ttotal seconds\tchecksums\tseconds of each stage\n", found)
+        print("Wrote %d timings to %s" % (len(found), BASELINE))
+    elif failed:
+        sys.exit("%d of %d benchmarks failed" % (failed, len(found)))
+
+
+def main(argv):
+    if len(argv) < 2 or argv[1] not in ("check", "bench"):
+        sys.exit(__doc__)
+    if "GISBASE" not in os.environ:
+        sys.exit("Run this inside a GRASS session")
+    update = "--update" in argv
+    tolerance = 1.25
+    if "--tolerance" in argv:
+        tolerance = float(argv[argv.index("--tolerance") + 1])
+    if argv[1] == "check":
+        check(update, "--large" in argv or os.environ.get("REGRESS_LARGE") == "1")
+    else:
+        bench(update, tolerance)
+
+
+if __name__ == "__main__":
+    main(sys.argv)
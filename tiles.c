@@ -0,0 +1,398 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <grass/gis.h>
+#include <grass/raster.h>
+#include <grass/glocale.h>
+#include "tinf.h"
+#include "ds.h"
+#include "local.h"
+
+/* Filling a map too large for one machine in three steps that only share
+ * files (Barnes, 2016).  Each tile is flooded on its own with its edges as
+ * outlets, as the strips of pflood() are, and keeps the label of the flood
+ * each cell belongs to in <tile>.labels.  The edges between the labels and
+ * the labels and filled elevations around the border of the tile go to
+ * <tile>.graph.  The merge joins the borders of all the tiles into one
+ * graph, solves it, and writes the spill level of every label of a tile
+ * to <tile>.spill.  Each tile is then raised to those levels on its own. */
+
+#define TILE_MAGIC 0x54444652	/* "RFDT" */
+#define TILE_VERSION 1
+
+struct tile_head
+{
+    int magic;
+    int version;
+    int rows, cols;
+    double north, west, ns_res, ew_res;
+    CELL nlabels;
+    size_t nedges;
+};
+
+/* a cell on the border of a tile; label 0 is null */
+struct border
+{
+    CELL label;
+    double elev;
+};
+
+/* a tile as the merge sees it */
+struct tile
+{
+    struct tile_head h;
+    struct sedge *edges;
+    struct border *ring;	/* top and bottom rows, then left and right columns */
+    int row0, col0;		/* position in the tiles as a whole */
+    CELL base;			/* added to its labels to make them unique */
+};
+
+static FILE *open_part(const char *base, const char *ext, const char *mode)
+{
+    char name[GPATH_MAX];
+    FILE *fp;
+
+    snprintf(name, sizeof(name), "%s.%s", base, ext);
+    if (!(fp = fopen(name, mode)))
+	G_fatal_error(_("Unable to open <%s>: %s"), name, strerror(errno));
+    return fp;
+}
+
+static void io(size_t done, size_t n, const char *base, const char *ext)
+{
+    if (done != n)
+	G_fatal_error(_("Error accessing <%s.%s>: %s"), base, ext,
+		      errno ? strerror(errno) : _("file is truncated"));
+}
+
+/* the border cell of a tile at row r and column c */
+static struct border *ring_at(struct tile *t, int r, int c)
+{
+    if (r == 0)
+	return t->ring + c;
+    if (r == t->h.rows - 1)
+	return t->ring + t->h.cols + c;
+    if (c == 0)
+	return t->ring + 2 * t->h.cols + r;
+    return t->ring + 2 * t->h.cols + t->h.rows + r;
+}
+
+static int cmp_edge(const void *a, const void *b)
+{
+    const struct sedge *x = a, *y = b;
+
+    if (x->a != y->a)
+	return x->a < y->a ? -1 : 1;
+    if (x->b != y->b)
+	return x->b < y->b ? -1 : 1;
+    return x->w < y->w ? -1 : x->w > y->w;
+}
+
+/* keep only the lowest edge between each pair of labels */
+static void compact(struct sgraph *g)
+{
+    size_t e, n;
+    CELL a;
+
+    for (e = 0; e < g->n; e += 1) {
+	if (g->v[e].a > g->v[e].b) {
+	    a = g->v[e].a;
+	    g->v[e].a = g->v[e].b;
+	    g->v[e].b = a;
+	}
+    }
+    qsort(g->v, g->n, sizeof(struct sedge), cmp_edge);
+    for (e = n = 0; e < g->n; e += 1) {
+	if (n > 0 && g->v[n - 1].a == g->v[e].a && g->v[n - 1].b == g->v[e].b)
+	    continue;
+	g->v[n++] = g->v[e];
+    }
+    g->n = n;
+}
+
+/* flood the current region of input on its own as one tile */
+void tile_flood(const char *input, const char *output, const char *base)
+{
+    int in_id, out_id, type, nl, ns, i, j;
+    struct Cell_head window;
+    struct Colors colors;
+    struct nullmask *mask;
+    struct sgraph g = { 0 };
+    struct tile t;
+    char *elev, *row;
+    CELL *label;
+    FILE *fp;
+
+    in_id = Rast_open_old(input, "");
+    type = Rast_get_map_type(in_id);
+    set_func_pointers(type);
+    G_get_window(&window);
+    nl = Rast_window_rows();
+    ns = Rast_window_cols();
+
+    elev = G_malloc((off_t) nl * ns * bpe());
+    label = G_malloc((off_t) nl * ns * sizeof(CELL));
+    mask = nullmask_init(nl, ns);
+    row = get_buf();
+
+    G_message(_("Reading tile..."));
+    for (i = 0; i < nl; i += 1) {
+	G_percent(i, nl, 2);
+	get_row(in_id, elev + (off_t) i * ns * bpe(), i);
+	for (j = 0; j < ns; j += 1) {
+	    label[(off_t) i * ns + j] = 0;
+	    if (is_null(elev + ((off_t) i * ns + j) * bpe()))
+		nullmask_set(mask, i, j);
+	}
+    }
+    G_percent(1, 1, 1);
+    Rast_close(in_id);
+
+    G_message(_("Flooding tile..."));
+    blocks_arrange(elev, nl, ns, bpe(), 1);
+    t.h.nlabels = flood_tile(elev, label, nl, ns, 0, nl, OCEAN + 1, mask, &g, 0);
+    blocks_arrange(elev, nl, ns, bpe(), 0);
+    blocks_arrange((char *)label, nl, ns, sizeof(CELL), 0);
+    compact(&g);
+    G_verbose_message(_("%d labels, %lu edges"), (int)t.h.nlabels,
+		      (unsigned long)g.n);
+
+    t.h.magic = TILE_MAGIC;
+    t.h.version = TILE_VERSION;
+    t.h.rows = nl;
+    t.h.cols = ns;
+    t.h.north = window.north;
+    t.h.west = window.west;
+    t.h.ns_res = window.ns_res;
+    t.h.ew_res = window.ew_res;
+    t.h.nedges = g.n;
+    t.ring = G_malloc(2 * (nl + ns) * sizeof(struct border));
+    /* each side in full, so that a tile one cell wide fills every slot */
+    for (j = 0; j < ns; j += 1) {
+	t.ring[j].label = label[j];
+	t.ring[j].elev = get_dbl(elev + j * bpe());
+	t.ring[ns + j].label = label[(off_t) (nl - 1) * ns + j];
+	t.ring[ns + j].elev =
+	    get_dbl(elev + ((off_t) (nl - 1) * ns + j) * bpe());
+    }
+    for (i = 0; i < nl; i += 1) {
+	t.ring[2 * ns + i].label = label[(off_t) i * ns];
+	t.ring[2 * ns + i].elev = get_dbl(elev + (off_t) i * ns * bpe());
+	t.ring[2 * ns + nl + i].label = label[(off_t) i * ns + ns - 1];
+	t.ring[2 * ns + nl + i].elev =
+	    get_dbl(elev + ((off_t) i * ns + ns - 1) * bpe());
+    }
+
+    fp = open_part(base, "graph", "wb");
+    io(fwrite(&t.h, sizeof(t.h), 1, fp), 1, base, "graph");
+    io(fwrite(g.v, sizeof(struct sedge), g.n, fp), g.n, base, "graph");
+    io(fwrite(t.ring, sizeof(struct border), 2 * (nl + ns), fp),
+       2 * (nl + ns), base, "graph");
+    io(fclose(fp) == 0, 1, base, "graph");
+
+    fp = open_part(base, "labels", "wb");
+    io(fwrite(label, sizeof(CELL), (size_t) nl * ns, fp), (size_t) nl * ns,
+       base, "labels");
+    io(fclose(fp) == 0, 1, base, "labels");
+
+    G_message(_("Writing flooded tile..."));
+    out_id = Rast_open_new(output, type);
+    for (i = 0; i < nl; i += 1) {
+	memcpy(row, elev + (off_t) i * ns * bpe(), ns * bpe());
+	put_row(out_id, row);
+    }
+    Rast_close(out_id);
+    if (Rast_read_colors(input, "", &colors) >= 0)
+	Rast_write_colors(output, G_mapset(), &colors);
+
+    G_free(g.v);
+    G_free(t.ring);
+    G_free(row);
+    G_free(elev);
+    G_free(label);
+    nullmask_free(mask);
+}
+
+/* join the borders of the tiles and write the spill levels of each */
+void tile_merge(char **bases, int n)
+{
+    int di[8] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+    int dj[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+    int t, u, k, i, j, r, c, *near, nnear;
+    struct tile *tiles, *p, *q;
+    struct border *a, *b;
+    struct sgraph *g;
+    CELL nlabels, l;
+    double *spill, s;
+    size_t e;
+    FILE *fp;
+
+    tiles = G_calloc(n, sizeof(struct tile));
+    g = G_calloc(n + 1, sizeof(struct sgraph));
+    nlabels = OCEAN + 1;
+    for (t = 0; t < n; t += 1) {
+	p = tiles + t;
+	errno = 0;
+	fp = open_part(bases[t], "graph", "rb");
+	io(fread(&p->h, sizeof(p->h), 1, fp), 1, bases[t], "graph");
+	if (p->h.magic != TILE_MAGIC || p->h.version != TILE_VERSION)
+	    G_fatal_error(_("<%s.graph> is not a tile graph of this version"),
+			  bases[t]);
+	p->edges = G_malloc(p->h.nedges * sizeof(struct sedge));
+	p->ring = G_malloc(2 * (p->h.rows + p->h.cols) * sizeof(struct border));
+	io(fread(p->edges, sizeof(struct sedge), p->h.nedges, fp),
+	   p->h.nedges, bases[t], "graph");
+	io(fread(p->ring, sizeof(struct border), 2 * (p->h.rows + p->h.cols),
+		 fp), 2 * (p->h.rows + p->h.cols), bases[t], "graph");
+	fclose(fp);
+
+	if (fabs(p->h.ns_res - tiles->h.ns_res) > 1e-9 * tiles->h.ns_res ||
+	    fabs(p->h.ew_res - tiles->h.ew_res) > 1e-9 * tiles->h.ew_res)
+	    G_fatal_error(_("<%s> has a different resolution"), bases[t]);
+	p->row0 = (int)floor((tiles->h.north - p->h.north) / p->h.ns_res + 0.5);
+	p->col0 = (int)floor((p->h.west - tiles->h.west) / p->h.ew_res + 0.5);
+
+	/* labels past the ocean are renumbered into one range */
+	p->base = nlabels - (OCEAN + 1);
+	nlabels += p->h.nlabels - (OCEAN + 1);
+	for (e = 0; e < p->h.nedges; e += 1)
+	    add_edge(&g[t],
+		     p->edges[e].a == OCEAN ? OCEAN : p->edges[e].a + p->base,
+		     p->edges[e].b == OCEAN ? OCEAN : p->edges[e].b + p->base,
+		     p->edges[e].w);
+	G_free(p->edges);
+    }
+    G_message(_("Joining %d tiles with %d labels..."), n, (int)nlabels);
+
+    /* a border cell drains into the neighbouring tile, into a null there,
+     * or off the map where there is no tile */
+    near = G_malloc(n * sizeof(int));
+    for (t = 0; t < n; t += 1) {
+	G_percent(t, n, 5);
+	p = tiles + t;
+	nnear = 0;
+	for (u = 0; u < n; u += 1) {
+	    q = tiles + u;
+	    if (u != t && q->row0 <= p->row0 + p->h.rows &&
+		q->row0 + q->h.rows >= p->row0 &&
+		q->col0 <= p->col0 + p->h.cols &&
+		q->col0 + q->h.cols >= p->col0)
+		near[nnear++] = u;
+	}
+	for (i = 0; i < p->h.rows; i += 1) {
+	    for (j = 0; j < p->h.cols; j += i == 0 || i == p->h.rows - 1 ||
+		 p->h.cols == 1 ? 1 : p->h.cols - 1) {
+		a = ring_at(p, i, j);
+		if (a->label == 0)
+		    continue;
+		l = a->label == OCEAN ? OCEAN : a->label + p->base;
+		for (k = 0; k < 8; k += 1) {
+		    if (i + di[k] >= 0 && i + di[k] < p->h.rows &&
+			j + dj[k] >= 0 && j + dj[k] < p->h.cols)
+			continue;
+		    r = p->row0 + i + di[k];
+		    c = p->col0 + j + dj[k];
+		    b = NULL;
+		    for (u = 0; u < nnear && !b; u += 1) {
+			q = tiles + near[u];
+			if (r >= q->row0 && r < q->row0 + q->h.rows &&
+			    c >= q->col0 && c < q->col0 + q->h.cols)
+			    b = ring_at(q, r - q->row0, c - q->col0);
+		    }
+		    if (!b || b->label == 0)
+			add_edge(&g[n], l, OCEAN, a->elev);
+		    else if (t < near[u - 1])
+			/* each pair of cells is seen from both sides */
+			add_edge(&g[n], l,
+				 b->label == OCEAN ? OCEAN : b->label + q->base,
+				 a->elev > b->elev ? a->elev : b->elev);
+		}
+	    }
+	}
+    }
+    G_percent(1, 1, 1);
+    G_free(near);
+
+    spill = solve_spill(g, n + 1, nlabels);
+    G_free(g);
+
+    for (t = 0; t < n; t += 1) {
+	p = tiles + t;
+	fp = open_part(bases[t], "spill", "wb");
+	for (l = 0; l < p->h.nlabels; l += 1) {
+	    s = l == 0 ? HUGE_VAL : spill[l == OCEAN ? OCEAN : l + p->base];
+	    io(fwrite(&s, sizeof(double), 1, fp), 1, bases[t], "spill");
+	}
+	io(fclose(fp) == 0, 1, bases[t], "spill");
+	G_free(p->ring);
+    }
+
+    G_free(spill);
+    G_free(tiles);
+}
+
+/* raise a flooded tile to the spill levels of its labels */
+void tile_apply(const char *input, const char *output, const char *base)
+{
+    int in_id, out_id, type, nl, ns, i, j;
+    struct Colors colors;
+    struct tile_head h;
+    double *spill;
+    CELL *label;
+    char *row, *cell;
+    FILE *fp;
+
+    errno = 0;
+    fp = open_part(base, "graph", "rb");
+    io(fread(&h, sizeof(h), 1, fp), 1, base, "graph");
+    fclose(fp);
+    if (h.magic != TILE_MAGIC || h.version != TILE_VERSION)
+	G_fatal_error(_("<%s.graph> is not a tile graph of this version"), base);
+
+    in_id = Rast_open_old(input, "");
+    type = Rast_get_map_type(in_id);
+    set_func_pointers(type);
+    nl = Rast_window_rows();
+    ns = Rast_window_cols();
+    if (nl != h.rows || ns != h.cols)
+	G_fatal_error(_("<%s> was flooded in a region of %d rows and %d columns"),
+		      base, h.rows, h.cols);
+
+    spill = G_malloc(h.nlabels * sizeof(double));
+    fp = open_part(base, "spill", "rb");
+    io(fread(spill, sizeof(double), h.nlabels, fp), h.nlabels, base, "spill");
+    fclose(fp);
+
+    label = G_malloc(ns * sizeof(CELL));
+    row = get_buf();
+    fp = open_part(base, "labels", "rb");
+    out_id = Rast_open_new(output, type);
+
+    G_message(_("Raising tile..."));
+    for (i = 0; i < nl; i += 1) {
+	G_percent(i, nl, 2);
+	io(fread(label, sizeof(CELL), ns, fp), ns, base, "labels");
+	get_row(in_id, row, i);
+	for (j = 0; j < ns; j += 1) {
+	    cell = row + j * bpe();
+	    if (label[j] <= 0 || label[j] >= h.nlabels || is_null(cell))
+		continue;
+	    if (spill[label[j]] < HUGE_VAL && spill[label[j]] > get_dbl(cell))
+		set_dbl(cell, spill[label[j]]);
+	}
+	put_row(out_id, row);
+    }
+    G_percent(1, 1, 1);
+    fclose(fp);
+
+    Rast_close(in_id);
+    Rast_close(out_id);
+    if (Rast_read_colors(input, "", &colors) >= 0)
+	Rast_write_colors(output, G_mapset(), &colors);
+
+    G_free(spill);
+    G_free(label);
+    G_free(row);
+}
@@ -25,6 +25,9 @@ void (*diff) (void *, void *);
 void (*sum) (void *, void *);
 void (*quot) (void *, void *);
 void (*prod) (void *, void *);
+double (*get_dbl) (void *);
+void (*set_dbl) (void *, double);
+void (*next_up) (void *);
 
 void set_func_pointers(int in_type)
 {
@@ -44,6 +47,9 @@ void set_func_pointers(int in_type)
 	sum = sum_c;
 	quot = quot_c;
 	prod = prod_c;
+	get_dbl = get_dbl_c;
+	set_dbl = set_dbl_c;
+	next_up = next_up_c;
 
 	break;
 
@@ -62,6 +68,9 @@ void set_func_pointers(int in_type)
 	sum = sum_f;
 	quot = quot_f;
 	prod = prod_f;
+	get_dbl = get_dbl_f;
+	set_dbl = set_dbl_f;
+	next_up = next_up_f;
 
 	break;
 
@@ -80,6 +89,9 @@ void set_func_pointers(int in_type)
 	sum = sum_d;
 	quot = quot_d;
 	prod = prod_d;
+	get_dbl = get_dbl_d;
+	set_dbl = set_dbl_d;
+	next_up = next_up_d;
     }
 
     return;
@@ -310,45 +322,65 @@ void prod_d(void *v1, void *v2)
     *(DCELL *) v1 *= *(DCELL *) v2;
 }
 
+/* return a value as a double, for reporting */
+double get_dbl_c(void *v)
+{
+    return (double)*(CELL *) v;
+}
+double get_dbl_f(void *v)
+{
+    return (double)*(FCELL *) v;
+}
+double get_dbl_d(void *v)
+{
+    return *(DCELL *) v;
+}
+
+/* store a double that came from a value of the same type */
+void set_dbl_c(void *v, double d)
+{
+    *(CELL *) v = (CELL) d;
+}
+void set_dbl_f(void *v, double d)
+{
+    *(FCELL *) v = (FCELL) d;
+}
+void set_dbl_d(void *v, double d)
+{
+    *(DCELL *) v = d;
+}
+
+/* raise a value by the smallest step the type can represent */
+void next_up_c(void *v)
+{
+    if (*(CELL *) v < INT_MAX)
+	*(CELL *) v += 1;
+}
+void next_up_f(void *v)
+{
+    *(FCELL *) v = nextafterf(*(FCELL *) v, FLT_MAX);
+}
+void next_up_d(void *v)
+{
+    *(DCELL *) v = nextafter(*(DCELL *) v, DBL_MAX);
+}
+
 /* probably not a function of general interest */
-/* calculate the slope between two cells, returned as a double  */
+/* calculate the slope between two cells, returned as a double.  The caller
+ * must already have checked that the second cell is not null */
 double slope_c(void *line1, void *line2, double cnst)
 {
-    double rc;
-    CELL *pedge;
-
-    rc = -HUGE_VAL;
-    pedge = (CELL *) line2;
-    if (!Rast_is_c_null_value(pedge)) {
-	rc = (*(CELL *) line1 - *pedge) / cnst;
-    }
-    return rc;
+    return (*(CELL *) line1 - *(CELL *) line2) / cnst;
 }
 
 double slope_f(void *line1, void *line2, double cnst)
 {
-    double rc;
-    FCELL *pedge;
-
-    rc = -HUGE_VAL;
-    pedge = (FCELL *) line2;
-    if (!Rast_is_f_null_value(pedge)) {
-	rc = (*(FCELL *) line1 - *pedge) / cnst;
-    }
-    return rc;
+    return (*(FCELL *) line1 - *(FCELL *) line2) / cnst;
 }
 
 double slope_d(void *line1, void *line2, double cnst)
 {
-    double rc;
-    DCELL *pedge;
-
-    rc = -HUGE_VAL;
-    pedge = (DCELL *) line2;
-    if (!Rast_is_d_null_value(pedge)) {
-	rc = (*(DCELL *) line1 - *pedge) / cnst;
-    }
-    return rc;
+    return (*(DCELL *) line1 - *(DCELL *) line2) / cnst;
 }
 
 /* read a line and update a three-line buffer */
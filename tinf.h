@@ -61,6 +61,18 @@ void prod_c(void *, void *);
 void prod_f(void *, void *);
 void prod_d(void *, void *);
 
+double get_dbl_c(void *);
+double get_dbl_f(void *);
+double get_dbl_d(void *);
+
+void set_dbl_c(void *, double);
+void set_dbl_f(void *, double);
+void set_dbl_d(void *, double);
+
+void next_up_c(void *);
+void next_up_f(void *);
+void next_up_d(void *);
+
 
 /* to add a new multitype function, add a pointer for the function and
  * its argument list to the list below */
@@ -79,6 +91,9 @@ extern void (*diff) (void *, void *);
 extern void (*sum) (void *, void *);
 extern void (*quot) (void *, void *);
 extern void (*prod) (void *, void *);
+extern double (*get_dbl) (void *);
+extern void (*set_dbl) (void *, double);
+extern void (*next_up) (void *);
 
 /* probably not something of general interest */
 
@@ -1,312 +1,251 @@
 #include <unistd.h>
 #include <sys/types.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <grass/gis.h>
 #include <grass/raster.h>
 #include <grass/glocale.h>
-
-struct whereandwhat
+#include "ds.h"
+
+/* The watershed of a problem area is every cell whose flow path ends in
+ * it.  Each cell holds the offset of the cell it drains to until its path
+ * is known to end, and then how it ends.  Every pass replaces what a cell
+ * holds with what the cell it points at holds, so the part of the path
+ * covered doubles each pass and the ends reach every cell in a number of
+ * passes that grows with the log of the longest path.  Paths end in the
+ * areas numbered by dopolys(), or without a watershed where they reach the
+ * first or last row, leave the data or meet a cell without a single
+ * direction.  When the offsets do not fit in the memory left, the labels
+ * are carried up the paths by sweeping the rows instead. */
+
+/* The offsets take 4 bytes a cell when the map is small enough and 8
+ * otherwise.  A cell below n points at that cell; n ends a path with no
+ * watershed and n + label ends one in a problem area, so that no value is
+ * above 2n. */
+struct links
 {
-    off_t offset;
-    CELL *p;
+    void *v;
+    int wide;
+    off_t n;
 };
 
-/*
-int recurse_cell(CELL flag, int i, int j, int nl, int ns,
-		 struct whereandwhat bas[], struct whereandwhat dir[])
-{
-    CELL edge;
-    int rc = 0;
+#define ENDED(l, v) ((v) >= (l)->n)
+#define END(l, label) ((l)->n + ((label) > 0 ? (label) : 0))
+#define LABEL(l, v) ((v) > (l)->n ? (int) ((v) - (l)->n) : -1)
 
-    if (j == 0 && j >= ns - 1)
-	return rc;
+/* The passes read offsets other threads are writing, so every access is
+ * atomic; on common machines these are plain loads and stores. */
+static inline off_t link_get(const struct links *l, off_t k)
+{
+    off_t v;
+    uint32_t u;
 
-    if (bas[i].p[j] != flag) {
-	rc = 1;
-	bas[i].p[j] = flag;
+    if (l->wide) {
+#pragma omp atomic read
+	v = ((off_t *) l->v)[k];
+	return v;
     }
+#pragma omp atomic read
+    u = ((uint32_t *) l->v)[k];
+    return (off_t) u;
+}
 
-    if (i > 0) {
-	edge = dir[i - 1].p[j - 1];
-	if (bas[i - 1].p[j - 1] == -1 && !Rast_is_c_null_value(&edge) &&
-	    edge == 4)
-	    rc += recurse_cell(flag, i - 1, j - 1, nl, ns, bas, dir);
-	edge = dir[i - 1].p[j];
-	if (bas[i - 1].p[j] == -1 && !Rast_is_c_null_value(&edge) && edge == 8)
-	    rc += recurse_cell(flag, i - 1, j, nl, ns, bas, dir);
-	edge = dir[i - 1].p[j + 1];
-	if (bas[i - 1].p[j + 1] == -1 && !Rast_is_c_null_value(&edge) &&
-	    edge == 16)
-	    rc += recurse_cell(flag, i - 1, j + 1, nl, ns, bas, dir);
-
+static inline void link_set(struct links *l, off_t k, off_t v)
+{
+    if (l->wide) {
+#pragma omp atomic write
+	((off_t *) l->v)[k] = v;
+    } else {
+#pragma omp atomic write
+	((uint32_t *) l->v)[k] = (uint32_t) v;
     }
+}
 
-    edge = dir[i].p[j - 1];
-    if (bas[i].p[j - 1] == -1 && !Rast_is_c_null_value(&edge) && edge == 2)
-	rc += recurse_cell(flag, i, j - 1, nl, ns, bas, dir);
+/* the bytes wtrshed() needs for the offsets of a map */
+off_t wtrshed_size(int nl, int ns)
+{
+    off_t n = (off_t) nl * ns;
 
-    edge = dir[i].p[j + 1];
-    if (bas[i].p[j + 1] == -1 && !Rast_is_c_null_value(&edge) && edge == 32)
-	rc += recurse_cell(flag, i, j + 1, nl, ns, bas, dir);
+    return n * (n < ((off_t) 1 << 31) ? sizeof(uint32_t) : sizeof(off_t));
+}
 
-    if (i < nl - 1) {
-	edge = dir[i + 1].p[j - 1];
-	if (bas[i + 1].p[j - 1] == -1 && !Rast_is_c_null_value(&edge) &&
-	    edge == 1)
-	    rc += recurse_cell(flag, i + 1, j - 1, nl, ns, bas, dir);
-	edge = dir[i + 1].p[j];
-	if (bas[i + 1].p[j] == -1 && !Rast_is_c_null_value(&edge) && edge == 128)
-	    rc += recurse_cell(flag, i + 1, j, nl, ns, bas, dir);
-	edge = dir[i + 1].p[j + 1];
-	if (bas[i + 1].p[j + 1] == -1 && !Rast_is_c_null_value(&edge) &&
-	    edge == 64)
-	    rc += recurse_cell(flag, i + 1, j + 1, nl, ns, bas, dir);
+/* the row and column steps of a direction; 0 if it is not a single one */
+static int step(CELL dir, int *di, int *dj)
+{
+    switch (dir) {
+    case 1:	*di = -1; *dj = 1; return 1;
+    case 2:	*di = 0; *dj = 1; return 1;
+    case 4:	*di = 1; *dj = 1; return 1;
+    case 8:	*di = 1; *dj = 0; return 1;
+    case 16:	*di = 1; *dj = -1; return 1;
+    case 32:	*di = 0; *dj = -1; return 1;
+    case 64:	*di = -1; *dj = -1; return 1;
+    case 128:	*di = -1; *dj = 0; return 1;
     }
-    return rc;
+    return 0;
 }
-*/
 
-int recurse_cell(CELL flag, int i, int j, int nl, int ns,
-		 struct whereandwhat bas[], struct whereandwhat dir[])
+/* whether a cell drains to a neighbour on the map; the first and last rows
+ * are never in a watershed */
+static int drains(int i, int j, int nl, int ns, CELL dir, int *di, int *dj)
 {
-    CELL edge;
-    int rc = 0;
-
-    if (j == 0 && j >= ns - 1)
-		return rc;
-
-    if (bas[i].p[j] != flag) {
-		rc = 1;
-		bas[i].p[j] = flag;
-    }
+    return i > 0 && i < nl - 1 && step(dir, di, dj) && i + *di >= 0 &&
+	i + *di < nl && j + *dj >= 0 && j + *dj < ns;
+}
 
-    if (i > 0) {
-		edge = dir[i - 1].p[j - 1];
-	
-		if (bas[i - 1].p[j - 1] == -1 && !Rast_is_c_null_value(&edge) && edge == 4)
-	    	rc += recurse_cell(flag, i - 1, j - 1, nl, ns, bas, dir);
-	
-		edge = dir[i - 1].p[j];
-	
-		if (bas[i - 1].p[j] == -1 && !Rast_is_c_null_value(&edge) && edge == 8)
-		    rc += recurse_cell(flag, i - 1, j, nl, ns, bas, dir);
-	
-		edge = dir[i - 1].p[j + 1];
-	
-		if (bas[i - 1].p[j + 1] == -1 && !Rast_is_c_null_value(&edge) && edge == 16)
-		    rc += recurse_cell(flag, i - 1, j + 1, nl, ns, bas, dir);
+/* point each cell of a row at its downstream cell, or end it */
+static void start_row(struct links *next, int i, int nl, int ns,
+		      const CELL *dir, const int *bas)
+{
+    int j, di, dj;
+    off_t k;
+
+    for (j = 0; j < ns; j += 1) {
+	k = (off_t) i * ns + j;
+	if (bas[j] > 0)
+	    link_set(next, k, END(next, bas[j]));
+	else if (!drains(i, j, nl, ns, dir[j], &di, &dj))
+	    link_set(next, k, END(next, -1));
+	else
+	    link_set(next, k, (off_t) (i + di) * ns + j + dj);
     }
+}
 
-    edge = dir[i].p[j - 1];
-
-    if (bas[i].p[j - 1] == -1 && !Rast_is_c_null_value(&edge) && edge == 2)
-		rc += recurse_cell(flag, i, j - 1, nl, ns, bas, dir);
-
-    edge = dir[i].p[j + 1];
-
-    if (bas[i].p[j + 1] == -1 && !Rast_is_c_null_value(&edge) && edge == 32)
-		rc += recurse_cell(flag, i, j + 1, nl, ns, bas, dir);
-
-    if (i < nl - 1) {
-		edge = dir[i + 1].p[j - 1];
-		
-		if (bas[i + 1].p[j - 1] == -1 && !Rast_is_c_null_value(&edge) && edge == 1)
-		    rc += recurse_cell(flag, i + 1, j - 1, nl, ns, bas, dir);
-
-		edge = dir[i + 1].p[j];
-		
-		if (bas[i + 1].p[j] == -1 && !Rast_is_c_null_value(&edge) && edge == 128)
-	    	rc += recurse_cell(flag, i + 1, j, nl, ns, bas, dir);
-	
-		edge = dir[i + 1].p[j + 1];
-		
-		if (bas[i + 1].p[j + 1] == -1 && !Rast_is_c_null_value(&edge) && edge == 64)
-	    	rc += recurse_cell(flag, i + 1, j + 1, nl, ns, bas, dir);
+/* Give the cells of row i that have no label yet the label of the cell
+ * they drain to, from the rows above and below as they are now.  Returns
+ * whether any cell changed. */
+static int sweep_row(int i, int nl, int ns, const CELL *dir, int *bas[3])
+{
+    int j, di, dj, rc = 0;
+
+    for (j = 0; j < ns; j += 1) {
+	if (bas[1][j] > 0 || !drains(i, j, nl, ns, dir[j], &di, &dj))
+	    continue;
+	if (bas[1 + di][j + dj] > 0) {
+	    bas[1][j] = bas[1 + di][j + dj];
+	    rc = 1;
+	}
     }
     return rc;
 }
 
-void wtrshed(char* prob, char* dirs, int nl, int ns, int mxbuf)
+/* Without room for the offsets, sweep down and then up the rows until no
+ * label moves.  Each sweep carries a label any distance along a path that
+ * keeps going the same way, so the passes grow with the number of turns
+ * up and down the longest path rather than with its length. */
+static void sweep(struct spans *prob, struct rows *dirs, int nl, int ns)
 {
-    int pass, repeat, flag, i, j, bufsz;
-    int sline, nline, rdline;
-
-    struct whereandwhat hold;
-    struct whereandwhat *dir;
-    struct whereandwhat *bas;
-
-   	char* probbuf;
-   	char* dirsbuf;
-
-    dir = G_malloc(mxbuf * sizeof(struct whereandwhat));
-    bas = G_malloc(mxbuf * sizeof(struct whereandwhat));
-
-    bufsz = ns * sizeof(CELL);
+    int pass, changed, i, d;
+    int *bas[3], *tmp;
+    CELL *dir = G_malloc(ns * sizeof(CELL));
 
-    /* adjust maxbuf to an even number */
-    mxbuf += mxbuf % 2 == 0 ? 0 : 1;
-
-    /* allocate buffers for drainage directions and basin areas */
-    for (i = 0; i < mxbuf; i += 1)
-		bas[i].p = (CELL *) G_calloc(ns, sizeof(CELL));
-    for (i = 0; i < mxbuf; i += 1)
-		dir[i].p = (CELL *) G_calloc(ns, sizeof(CELL));
+    for (i = 0; i < 3; i += 1)
+	bas[i] = G_malloc(ns * sizeof(int));
 
     pass = 0;
-
-    /* complete a downward pass */
     do {
-		G_verbose_message(_("Watershed pass %d"), ++pass);
-		repeat = 0;
-
-		/* fill the buffer */
-		nline = mxbuf;
-		sline = 0;
-		rdline = 1;
-		for (i = 0; i < mxbuf; i++) {
-		    bas[i].offset = dir[i].offset = (off_t) rdline *bufsz;
-
-		    probbuf = prob + bas[i].offset;
-		    memcpy(bas[i].p, probbuf, bufsz);
-		    probbuf += bufsz;
-
-		    dirsbuf = dirs + dir[i].offset;
-		    memcpy(dir[i].p, dirsbuf, bufsz);
-		    dirsbuf += bufsz;
-
-		    rdline++;
-		}
-
-		/* repeat for all subsequent rows except the first and last */
-		for (i = 1; i < nl - 1; i += 1) {
-		    /* analyse one line */
-		    for (j = 1; j < ns - 1; j += 1) {
-				flag = bas[sline].p[j];
-				if (flag > 0) {
-					//G_verbose_message(_("Recurse cell (a)."));
-			    	if (recurse_cell(flag, sline, j, nline, ns, bas, dir) > 0)
-						repeat = 1;
-				}
-			}
-
-		    /* write one line */
-		    probbuf = prob + bas[sline].offset;
-		    memcpy(probbuf, bas[sline].p, bufsz);
-		    probbuf += bufsz;
-
-		    /* If the bottom end of the buffers reach the bottom of the file, 
-		     * rotate the buffers and read new lines */
-		    if (rdline < nl - 1) {
-				hold = bas[0];
-				for (j = 1; j < mxbuf; j += 1)
-				    bas[j - 1] = bas[j];
-				bas[mxbuf - 1] = hold;
-
-				hold = dir[0];
-				for (j = 1; j < mxbuf; j += 1)
-				    dir[j - 1] = dir[j];
-				dir[mxbuf - 1] = hold;
-
-				bas[mxbuf - 1].offset = dir[mxbuf - 1].offset = (off_t) rdline *bufsz;
-
-				probbuf = prob + bas[mxbuf - 1].offset;
-				memcpy(bas[mxbuf - 1].p, probbuf, bufsz);
-				probbuf += bufsz;
-
-				dirsbuf = dirs + dir[mxbuf - 1].offset;
-				memcpy(dir[mxbuf - 1].p, dirsbuf, bufsz);
-				dirsbuf += bufsz;
-
-				rdline++;
-		    }
-		    /* After the buffer reaches the bottom of the file, stop reading file,
-		     * just advance the pointers */
-		    else {
-				nline -= 1;
-				sline += 1;
-		    }
-
-		}
-
-
-		/* fill the buffer */
-		nline = mxbuf;
-		rdline = nl - 2;
-		for (i = mxbuf - 1; i >= 0; i -= 1) {
-		    bas[i].offset = dir[i].offset = (off_t) rdline *bufsz;
-
-		    probbuf = prob + bas[i].offset;
-		    memcpy(bas[i].p, probbuf, bufsz);
-		    probbuf += bufsz;
-
-		    dirsbuf = dirs + dir[i].offset;
-		    memcpy(dir[i].p, dirsbuf, bufsz);
-		    dirsbuf += bufsz;
-
-		    rdline--;
+	changed = 0;
+	/* bas[1] is the row being swept, bas[1 - d] the one swept before
+	 * and bas[1 + d] the one after it */
+	for (d = 1; d >= -1; d -= 2) {
+	    G_verbose_message(_("Watershed pass %d"), ++pass);
+	    i = d > 0 ? 1 : nl - 2;
+	    if (i < 1 || i > nl - 2)
+		break;
+	    spans_get_row(prob, i - d, bas[1 - d]);
+	    spans_get_row(prob, i, bas[1]);
+	    for (; i >= 1 && i <= nl - 2; i += d) {
+		spans_get_row(prob, i + d, bas[1 + d]);
+		rows_get(dirs, i, dir);
+		if (sweep_row(i, nl, ns, dir, bas)) {
+		    spans_put_row(prob, i, bas[1]);
+		    changed = 1;
 		}
+		tmp = bas[1 - d];
+		bas[1 - d] = bas[1];
+		bas[1] = bas[1 + d];
+		bas[1 + d] = tmp;
+	    }
+	}
+    } while (changed);
+
+    for (i = 0; i < 3; i += 1)
+	G_free(bas[i]);
+    G_free(dir);
+}
 
-		/* repeat */
-		for (i = nl - 2; i >= 1; i -= 1) {
-		    /* analyse one line */
-		    for (j = 1; j < ns - 1; j += 1) {
-				flag = bas[nline - 1].p[j];
-				if (flag > 0) {
-					//G_verbose_message(_("Recurse cell (b)."));
-				    if (recurse_cell(flag, nline - 1, j, nline, ns, bas, dir) > 0)
-						repeat = 1;
-				}
-		    }
-
-		    /* write one line */
-		    probbuf = prob + bas[nline - 1].offset;
-		    memcpy(probbuf, bas[nline - 1].p, bufsz);
-		    probbuf += bufsz;
-
-		    /* Until the top of the buffers reach the top of the file, 
-		     * rotate the buffers and read new lines */
-		    if (rdline >= 1) {
-				hold = bas[nline - 1];
-				for (j = nline - 1; j > 0; j -= 1)
-			    	bas[j] = bas[j - 1];
-				bas[0] = hold;
-
-				hold = dir[nline - 1];
-				for (j = nline - 1; j > 0; j -= 1)
-			    	dir[j] = dir[j - 1];
-				dir[0] = hold;
-
-				bas[0].offset = dir[0].offset = (off_t) rdline *bufsz;
-
-				probbuf = prob + bas[0].offset;
-				memcpy(bas[0].p, probbuf, bufsz);
-				probbuf += bufsz;
-
-				dirsbuf = dirs + dir[0].offset;
-				memcpy(dir[0].p, dirsbuf, bufsz);
-				dirsbuf += bufsz;
-
-				rdline--;
-		    }
-		    /* after the buffer reaches the top of the file, just decrease the
-		     * line count */
-		    else
-			nline -= 1;
-
-		}
-
-    } while (repeat);
-
-
-    /* allocate buffers for drainage directions and basin areas */
-    for (i = 0; i < mxbuf; i += 1)
-		G_free(bas[i].p);
-    for (i = 0; i < mxbuf; i += 1)
-		G_free(dir[i].p);
+/* Find the watersheds with at most limit bytes for the offsets. */
+void wtrshed(struct spans* prob, struct rows* dirs, int nl, int ns, off_t limit)
+{
+    int pass, changed, i;
+    off_t k, n;
+    struct links links, *next = &links;
+
+    n = (off_t) nl * ns;
+    if (wtrshed_size(nl, ns) > limit) {
+	G_verbose_message(_("Sweeping the rows for the watersheds to stay within the memory limit"));
+	sweep(prob, dirs, nl, ns);
+	return;
+    }
+    links.n = n;
+    links.wide = n >= ((off_t) 1 << 31);
+    links.v = G_malloc(wtrshed_size(nl, ns));
+
+    /* compressed rows are expanded one at a time */
+#pragma omp parallel if (dirs->z == NULL)
+    {
+	CELL *dir = G_malloc(ns * sizeof(CELL));
+	int *bas = G_malloc(ns * sizeof(int));
+
+#pragma omp for schedule(static)
+	for (i = 0; i < nl; i += 1) {
+	    rows_get(dirs, i, dir);
+	    spans_get_row(prob, i, bas);
+	    start_row(next, i, nl, ns, dir, bas);
+	}
+	G_free(dir);
+	G_free(bas);
+    }
 
-    G_free(dir);
-    G_free(bas);
+    /* A cell may read a target that another thread is replacing; either
+     * value lies further down the same path, so the passes only go on
+     * until neither changes.  Paths that loop never end and are cut off
+     * once any path in the map would have ended. */
+    pass = 0;
+    do {
+	G_verbose_message(_("Watershed pass %d"), ++pass);
+	changed = 0;
+#pragma omp parallel for schedule(static) reduction(|:changed)
+	for (k = 0; k < n; k += 1) {
+	    off_t v = link_get(next, k), w;
+
+	    if (ENDED(next, v))
+		continue;
+	    w = link_get(next, v);
+	    if (w != v) {
+		link_set(next, k, w);
+		changed = 1;
+	    }
+	}
+    } while (changed && pass < 64);
+
+#pragma omp parallel
+    {
+	int *bas = G_malloc(ns * sizeof(int));
+	off_t v;
+	int j;
+
+#pragma omp for schedule(static)
+	for (i = 0; i < nl; i += 1) {
+	    for (j = 0; j < ns; j += 1) {
+		v = link_get(next, (off_t) i * ns + j);
+		bas[j] = ENDED(next, v) ? LABEL(next, v) : -1;
+	    }
+	    spans_put_row(prob, i, bas);
+	}
+	G_free(bas);
+    }
 
-    
+    G_free(links.v);
 }